@@ -55,9 +55,10 @@
 
 /* 
  * The first 512 megs of physical space can be addressed in both kseg0 and
- * kseg1. We use kseg0 for the kernel. This macro returns the kernel virtual
- * address of a given physical address within that range. (We assume we're
- * not using systems with more physical space than that anyway.)
+ * kseg1. We use kseg0 for the kernel. PADDR_TO_KVADDR returns the kernel
+ * virtual address of a given physical address within that range, and
+ * KVADDR_TO_PADDR goes the other way. (We assume we're not using systems
+ * with more physical space than that anyway.)
  *
  * N.B. If you, say, call a function that returns a paddr or 0 on error,
  * check the paddr for being 0 *before* you use this macro. While paddr 0
@@ -66,6 +67,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
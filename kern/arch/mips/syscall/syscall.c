@@ -35,6 +35,8 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -75,6 +77,33 @@
  * stack, starting at sp+16 to skip over the slots for the
  * registerized values, with copyin().
  */
+#if defined(UW) && !OPT_DUMBVM
+/*
+ * mmap has six arguments, the last 64-bit: fd and offset are on the
+ * user stack, offset aligned to 8 bytes.
+ */
+static
+int
+syscall_mmap(struct trapframe *tf, vaddr_t *retval)
+{
+	int fd;
+	off_t offset;
+	int result;
+
+	result = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+	if (result) {
+		return result;
+	}
+	result = copyin((const_userptr_t)(tf->tf_sp + 24), &offset,
+			sizeof(offset));
+	if (result) {
+		return result;
+	}
+	return sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+			(int)tf->tf_a2, (int)tf->tf_a3, fd, offset, retval);
+}
+#endif
+
 void
 syscall(struct trapframe *tf)
 {
@@ -129,6 +158,23 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+	case SYS_settickets:
+	  err = sys_settickets((int)tf->tf_a0);
+	  break;
+#if !OPT_DUMBVM
+	case SYS_mmap:
+	  err = syscall_mmap(tf, (vaddr_t *)&retval);
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((userptr_t)tf->tf_a0,
+			   (size_t)tf->tf_a1);
+	  break;
+	case SYS_madvise:
+	  err = sys_madvise((userptr_t)tf->tf_a0,
+			    (size_t)tf->tf_a1,
+			    (int)tf->tf_a2);
+	  break;
+#endif
 #endif // UW
 
 	    /* Add stuff here */
@@ -30,78 +30,143 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <uw-vmstats.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
  * enough to struggle off the ground.
+ *
+ * Physical memory for each region is still allocated up front, but
+ * its contents are not: each page is read from the executable, or
+ * zeroed, the first time it faults.
  */
 
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
-/*
- * Wrap rma_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	coremap_bootstrap();
+	vmstats_init();
 }
 
+/*
+ * Get physically contiguous memory for a user region. Kernel pages
+ * come from alloc_kpages, in coremap.c.
+ */
 static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return coremap_alloc(npages, false);
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+/*
+ * dumbvm never sends shootdowns itself, but carry them out anyway
+ * rather than dying if someone else does. Without ASIDs, an entry
+ * is matched on its page alone.
+ */
+void
+vm_tlbshootdown_all(void)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
-	return PADDR_TO_KVADDR(pa);
+	splx(spl);
 }
 
-void 
-free_kpages(vaddr_t addr)
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	/* nothing - leak the memory. */
+	int i, spl;
 
-	(void)addr;
+	spl = splhigh();
+	i = tlb_probe(ts->ts_vaddr & TLBHI_VPAGE, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
 }
 
-void
-vm_tlbshootdown_all(void)
+/*
+ * Every dumbvm refill goes through vm_fault, which charges it to the
+ * thread itself.
+ */
+unsigned
+vm_tlbrefills(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	return 0;
 }
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+/*
+ * Fill in the page at VADDR, whose frame is PADDR, on first touch.
+ * The part of it covered by SB (if any) is read from the executable;
+ * the rest is zeroed.
+ */
+static
+int
+load_page(struct addrspace *as, const struct segbacking *sb,
+	  vaddr_t vaddr, paddr_t paddr)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	char *kva;
+	int result;
+
+	kva = (char *)PADDR_TO_KVADDR(paddr);
+	bzero(kva, PAGE_SIZE);
+
+	if (sb == NULL || sb->sb_filesz == 0) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	start = vaddr;
+	if (start < sb->sb_vaddr) {
+		start = sb->sb_vaddr;
+	}
+	end = vaddr + PAGE_SIZE;
+	if (end > sb->sb_vaddr + sb->sb_filesz) {
+		end = sb->sb_vaddr + sb->sb_filesz;
+	}
+	if (start >= end) {
+		/* Page is entirely bss. */
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	KASSERT(as->as_vnode != NULL);
+	uio_kinit(&iov, &ku, kva + (start - vaddr), end - start,
+		  sb->sb_offset + (start - sb->sb_vaddr), UIO_READ);
+	result = VOP_READ(as->as_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	return 0;
 }
 
 int
@@ -109,7 +174,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
+	const struct segbacking *sb;
+	unsigned pageindex;
+	int i, result;
 	uint32_t ehi, elo;
 	struct addrspace *as;
 	int spl;
@@ -155,6 +222,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT(as->as_pbase2 != 0);
 	KASSERT(as->as_npages2 != 0);
 	KASSERT(as->as_stackpbase != 0);
+	KASSERT(as->as_loaded != NULL);
 	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
 	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
@@ -170,12 +238,20 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
+		sb = &as->as_back1;
+		pageindex = (faultaddress - vbase1) / PAGE_SIZE;
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
 		paddr = (faultaddress - vbase2) + as->as_pbase2;
+		sb = &as->as_back2;
+		pageindex = as->as_npages1 +
+			(faultaddress - vbase2) / PAGE_SIZE;
 	}
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+		sb = NULL;
+		pageindex = as->as_npages1 + as->as_npages2 +
+			(faultaddress - stackbase) / PAGE_SIZE;
 	}
 	else {
 		return EFAULT;
@@ -184,6 +260,18 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
+	/* Every TLB refill comes through here; count it for the scheduler. */
+	curthread->t_tlbfaults++;
+
+	/* First touch: bring the page in before mapping it. */
+	if (!bitmap_isset(as->as_loaded, pageindex)) {
+		result = load_page(as, sb, faultaddress, paddr);
+		if (result) {
+			return result;
+		}
+		bitmap_mark(as->as_loaded, pageindex);
+	}
+
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
@@ -220,6 +308,10 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	as->as_vnode = NULL;
+	bzero(&as->as_back1, sizeof(as->as_back1));
+	bzero(&as->as_back2, sizeof(as->as_back2));
+	as->as_loaded = NULL;
 
 	return as;
 }
@@ -227,6 +319,21 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
+	if (as->as_loaded != NULL) {
+		bitmap_destroy(as->as_loaded);
+	}
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
 	kfree(as);
 }
 
@@ -275,6 +382,14 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
+	/*
+	 * Nothing gets copied in through uiomove any more, so check
+	 * here that the region is in user space.
+	 */
+	if (sz > USERSPACETOP || vaddr > USERSPACETOP - sz) {
+		return EFAULT;
+	}
+
 	/* We don't use these - all pages are read-write */
 	(void)readable;
 	(void)writeable;
@@ -299,19 +414,13 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return EUNIMP;
 }
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
 int
 as_prepare_load(struct addrspace *as)
 {
 	KASSERT(as->as_pbase1 == 0);
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
+	KASSERT(as->as_loaded == NULL);
 
 	as->as_pbase1 = getppages(as->as_npages1);
 	if (as->as_pbase1 == 0) {
@@ -327,14 +436,52 @@ as_prepare_load(struct addrspace *as)
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
-	
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
+
+	/* Pages are zeroed or read in by vm_fault as they are touched. */
+	as->as_loaded = bitmap_create(as->as_npages1 + as->as_npages2 +
+				      DUMBVM_STACKPAGES);
+	if (as->as_loaded == NULL) {
+		return ENOMEM;
+	}
 
 	return 0;
 }
 
+int
+as_define_backing(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t memsize, size_t filesize)
+{
+	struct segbacking *sb;
+	vaddr_t vtop1, vtop2;
+
+	KASSERT(filesize <= memsize);
+
+	vtop1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	vtop2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	if (vaddr >= as->as_vbase1 && vaddr < vtop1 &&
+	    memsize <= vtop1 - vaddr) {
+		sb = &as->as_back1;
+	}
+	else if (vaddr >= as->as_vbase2 && vaddr < vtop2 &&
+		 memsize <= vtop2 - vaddr) {
+		sb = &as->as_back2;
+	}
+	else {
+		return EFAULT;
+	}
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	sb->sb_vaddr = vaddr;
+	sb->sb_offset = offset;
+	sb->sb_filesz = filesize;
+	return 0;
+}
+
 int
 as_complete_load(struct addrspace *as)
 {
@@ -355,6 +502,7 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	unsigned i, npages;
 
 	new = as_create();
 	if (new==NULL) {
@@ -376,6 +524,20 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	KASSERT(new->as_pbase2 != 0);
 	KASSERT(new->as_stackpbase != 0);
 
+	/* Share the executable; pages not yet loaded stay that way. */
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+	new->as_back1 = old->as_back1;
+	new->as_back2 = old->as_back2;
+	npages = old->as_npages1 + old->as_npages2 + DUMBVM_STACKPAGES;
+	for (i=0; i<npages; i++) {
+		if (bitmap_isset(old->as_loaded, i)) {
+			bitmap_mark(new->as_loaded, i);
+		}
+	}
+
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
 		old->as_npages1*PAGE_SIZE);
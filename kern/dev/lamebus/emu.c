@@ -52,6 +52,7 @@
 #include <platform/bus.h>
 #include <vfs.h>
 #include <emufs.h>
+#include <pagecache.h>
 #include "autoconf.h"
 
 /* Register offsets */
@@ -585,10 +586,14 @@ emufs_write(struct vnode *v, struct uio *uio)
 	struct emufs_vnode *ev = v->vn_data;
 	uint32_t amt;
 	size_t oldresid;
+	off_t start;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	start = uio->uio_offset;
+	result = 0;
+
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -599,7 +604,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 
 		if (uio->uio_resid == oldresid) {
@@ -608,7 +613,9 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	/* Bring cached copies of what was written up to date. */
+	pagecache_update(v, start, uio->uio_offset);
+	return result;
 }
 
 /*
@@ -717,7 +724,21 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	off_t oldsize;
+	int result;
+
+	result = emu_getsize(ev->ev_emu, ev->ev_handle, &oldsize);
+	if (result) {
+		return result;
+	}
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result) {
+		return result;
+	}
+
+	/* Bring cached copies of anything cut off up to date. */
+	pagecache_update(v, len, oldsize);
+	return 0;
 }
 
 /*
@@ -837,13 +858,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Regular files can be mapped. There is nothing to set up: the VM
+ * system moves mapped pages with VOP_READ and VOP_WRITE.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
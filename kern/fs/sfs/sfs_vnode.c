@@ -44,11 +44,22 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <kmem.h>
+#include <pagecache.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Further down, with sfs_truncate */
+static int sfs_dotruncate(struct vnode *v, off_t len);
+
+/*
+ * Object cache for sfs_vnode structures, shared by all mounted SFS
+ * volumes. Made the first time a vnode is loaded (under the big lock).
+ */
+static struct kmem_cache *sfs_vnode_cache;
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -910,9 +921,14 @@ sfs_reclaim(struct vnode *v)
 		return EBUSY;
 	}
 
-	/* If there are no on-disk references to the file either, erase it. */
+	/*
+	 * If there are no on-disk references to the file either, erase it.
+	 * (Not with VOP_TRUNCATE: the page cache holds a reference to any
+	 * vnode it has pages of, so it has none of this one to update,
+	 * and we may be here from pagecache_reclaim with the pages locked.)
+	 */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(&sv->sv_v, 0);
 		if (result) {
 			vfs_biglock_release();
 			return result;
@@ -953,7 +969,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -979,21 +995,26 @@ sfs_read(struct vnode *v, struct uio *uio)
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Called for write(). sfs_io() does the work. Cached copies of what
+ * was written are brought up to date afterwards.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t start;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	start = uio->uio_offset;
+
 	vfs_biglock_acquire();
 	result = sfs_io(sv, uio);
 	vfs_biglock_release();
 
+	pagecache_update(v, start, uio->uio_offset);
 	return result;
 }
 
@@ -1110,22 +1131,26 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Regular files can be mapped; the VM system reads
+ * mapped pages into frames of its own (kept in its page cache) with
+ * sfs_read and writes them back with sfs_write, so there is nothing
+ * to set up here.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Truncate (or extend) the file. Called from sfs_truncate and
+ * sfs_reclaim.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_dotruncate(struct vnode *v, off_t len)
 {
 	/*
 	 * I/O buffer for handling the indirect block.
@@ -1224,6 +1249,29 @@ sfs_truncate(struct vnode *v, off_t len)
 	return 0;
 }
 
+/*
+ * Called for ftruncate(). Cached copies of anything cut off are
+ * brought up to date afterwards.
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	off_t oldsize;
+	int result;
+
+	vfs_biglock_acquire();
+	oldsize = sv->sv_i.sfi_size;
+	result = sfs_dotruncate(v, len);
+	vfs_biglock_release();
+
+	if (result == 0) {
+		pagecache_update(v, len, oldsize);
+	}
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1357,6 +1405,7 @@ sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
+	bool gone;
 	int slot;
 	int result;
 
@@ -1370,18 +1419,26 @@ sfs_remove(struct vnode *dir, const char *name)
 	}
 
 	/* Erase its directory entry. */
+	gone = false;
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		gone = victim->sv_i.sfi_linkcount == 0;
+	}
+
+	vfs_biglock_release();
+
+	if (gone) {
+		/* Cached pages would keep the file from being erased. */
+		pagecache_invalidate(&victim->sv_v);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1685,7 +1742,17 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	KASSERT(vfs_biglock_do_i_hold());
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode),
+						    NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1766,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1803,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1814,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -35,18 +35,40 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
+#include "opt-dumbvm.h"
 
 struct vnode;
+struct bitmap;
+struct pagetable;
 
 
+/*
+ * File backing for a region: the bytes [sb_vaddr, sb_vaddr+sb_filesz)
+ * come from the executable (or mapped file) at offset sb_offset.
+ * Everything else in the region is zero-filled. A mapped file backs
+ * the whole of its region; what is past the end of the file reads as
+ * zero.
+ */
+struct segbacking {
+  vaddr_t sb_vaddr;
+  off_t sb_offset;
+  size_t sb_filesz;
+};
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
- *
- * You write this.
  */
 
+#if OPT_DUMBVM
+
+/*
+ * Pages are filled in on first touch: as_loaded has one bit per page
+ * of region 1, region 2 and the stack, in that order, set once the
+ * page has been read from as_vnode or zeroed.
+ */
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -55,8 +77,63 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+  struct vnode *as_vnode;
+  struct segbacking as_back1;
+  struct segbacking as_back2;
+  struct bitmap *as_loaded;
+};
+
+#else
+
+/* Region permissions. */
+#define RG_READ       0x4
+#define RG_WRITE      0x2
+#define RG_EXEC       0x1
+
+/* Region flags. */
+#define RG_MAPPED     0x1       /* made by mmap; may be munmapped */
+#define RG_SHARED     0x2       /* MAP_SHARED: writes go to the file */
+
+/*
+ * A region is a page-aligned range of the address space with a single
+ * set of permissions, optionally backed by part of the executable or,
+ * for mmap regions, of rg_vnode.
+ */
+struct region {
+  vaddr_t rg_vbase;
+  size_t rg_npages;
+  int rg_perms;                 /* RG_* */
+  int rg_flags;                 /* RG_MAPPED, RG_SHARED */
+  struct vnode *rg_vnode;       /* mapped file, or NULL for as_vnode */
+  struct segbacking rg_back;
+  int rg_advice;                /* MADV_NORMAL, _RANDOM, _SEQUENTIAL */
+  vaddr_t rg_fanext;            /* fault-around: next page if sequential */
+  unsigned rg_fawindow;         /* fault-around: pages to prefetch */
 };
 
+#ifndef ADDRSPACEINLINE
+#define ADDRSPACEINLINE INLINE
+#endif
+
+DECLARRAY(region);
+DEFARRAY(region, ADDRSPACEINLINE);
+
+/*
+ * Regions may be anywhere in user space and there may be any number
+ * of them. Their pages are allocated one frame at a time as they are
+ * first touched and recorded in as_pt.
+ */
+struct addrspace {
+  struct regionarray as_regions;
+  struct pagetable *as_pt;
+  struct vnode *as_vnode;       /* executable backing the regions */
+  unsigned as_asid;             /* TLB address space ID */
+  uint32_t as_asidgen;          /* generation as_asid belongs to */
+  uint32_t as_cpus;             /* cpus that may cache as_asid entries */
+};
+
+#endif /* OPT_DUMBVM */
+
 /*
  * Functions in addrspace.c:
  *
@@ -85,12 +162,38 @@ struct addrspace {
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
+ *    as_define_backing - record that part of a region is backed by
+ *                the executable V. The data is read in when each page
+ *                is first touched.
+ *
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                Without dumbvm, the stack is as_getstacklimit() pages
+ *                of address space, faulted in as it is used.
+ *
+ *    as_getstacklimit, as_setstacklimit - get or set the size, in
+ *                pages, of stacks made from now on. (Not with dumbvm.)
+ *
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *                (Not with dumbvm.)
+ *
+ *    as_map    - add a region of LEN bytes for mmap, at an address of
+ *                the kernel's choosing, returned in *RET. If V is not
+ *                NULL the region maps V from OFFSET, privately or (with
+ *                RG_SHARED in FLAGS) shared; otherwise it is anonymous
+ *                zero-fill memory. (Not with dumbvm.)
+ *
+ *    as_unmap  - remove the mmap regions in [VADDR, VADDR+LEN), writing
+ *                modified shared pages back to their files. The range
+ *                may not split a region. (Not with dumbvm.)
+ *
+ *    as_advise - apply madvise ADVICE to [VADDR, VADDR+LEN). Access
+ *                pattern advice applies to whole regions. (Not with
+ *                dumbvm.)
  */
 
 struct addrspace *as_create(void);
@@ -105,9 +208,24 @@ int               as_define_region(struct addrspace *as,
                                    int writeable,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t memsize, size_t filesize);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if !OPT_DUMBVM
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int               as_map(struct addrspace *as, size_t len, int perms,
+                         int flags, struct vnode *v, off_t offset,
+                         vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_advise(struct addrspace *as, vaddr_t vaddr, size_t len,
+                            int advice);
+unsigned          as_getstacklimit(void);
+int               as_setstacklimit(unsigned npages);
+#endif
+
 
 /*
  * Functions in loadelf.c
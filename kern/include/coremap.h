@@ -0,0 +1,95 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page frame allocator.
+ *
+ * The coremap describes every physical page frame handed to the VM
+ * system by ram_getsize(). Free frames are kept on buddy free lists,
+ * one list per block order, so allocation and free are O(log n) in
+ * the amount of RAM rather than a scan of the whole coremap.
+ * Single frames are additionally cached per cpu (see struct cpu) so
+ * the common one-page case usually avoids the global coremap lock.
+ *
+ * Functions:
+ *     coremap_bootstrap  - build the coremap from ram_getsize(). Called
+ *                          once, from vm_bootstrap().
+ *     coremap_alloc      - allocate NPAGES physically contiguous frames.
+ *                          ISKERN marks them as kernel (vs. user) memory.
+ *                          Returns 0 if out of memory. User allocations
+ *                          fail while the kernel still has a few frames
+ *                          left, so that paging can make room.
+ *     coremap_allocz     - allocate one zero-filled user frame, from the
+ *                          pool of frames zeroed while idle if it has
+ *                          any. Returns 0 if out of memory.
+ *     coremap_zeroidle   - zero the next 512 bytes of a frame for the
+ *                          pool, if it wants one and memory isn't short.
+ *                          Returns false if it didn't. Called by idle
+ *                          cpus, repeatedly, checking for work in
+ *                          between.
+ *     coremap_free       - release a run allocated by coremap_alloc,
+ *                          given the physical address of its first frame.
+ *                          If the run is shared, this just drops one
+ *                          reference; it is freed when the last goes.
+ *                          For a frame the page cache holds, this drops
+ *                          the cache's reference.
+ *     coremap_share      - add a reference to the user frame at PA for a
+ *                          mapping of it by AS at VADDR (copy-on-write,
+ *                          or the page cache handing it out).
+ *     coremap_unshare    - drop the reference coremap_share took for AS
+ *                          at VADDR. The frame is pageable again once
+ *                          only one mapping is left.
+ *     coremap_pcshare    - add the page cache's reference to the user
+ *                          frame at PA. Unlike other sharers, the cache
+ *                          doesn't stop the frame's one mapping from
+ *                          being paged out.
+ *     coremap_refcount   - return the number of references to the run
+ *                          at PA.
+ *     coremap_nframes    - return the number of frames managed.
+ *     coremap_setowner   - record that the user frame at PA, which has
+ *                          just been allocated, is mapped by AS at VADDR,
+ *                          making it pageable.
+ *     coremap_clock      - advance the pageout clock hand over the
+ *                          pageable frames, calling VISIT on each, until
+ *                          VISIT returns true or the hand has gone round
+ *                          twice. PCACHE tells VISIT the page cache also
+ *                          holds the frame. VISIT is called with the
+ *                          coremap locked and must not sleep or call
+ *                          back into the coremap.
+ *     coremap_printstats - print free, used, and fragmented frame counts,
+ *                          and per-cpu frame cache and zeroed pool
+ *                          hit/miss counts.
+ *
+ * Before coremap_bootstrap runs, alloc_kpages falls back to
+ * ram_stealmem(); pages obtained that way are never reclaimed.
+ */
+
+/* Largest block order kept on the free lists: 2^12 pages = 16M. */
+#define CM_MAXORDER   12
+#define CM_NORDERS    (CM_MAXORDER + 1)
+
+/*
+ * Free frames in blocks below this order (that is, isolated runs of
+ * fewer than 2^CM_FRAGORDER pages) are reported as fragmented.
+ */
+#define CM_FRAGORDER  2
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages, bool iskern);
+paddr_t coremap_allocz(void);
+bool coremap_zeroidle(void);
+void coremap_free(paddr_t pa);
+struct addrspace;
+void coremap_share(paddr_t pa, struct addrspace *as, vaddr_t vaddr);
+void coremap_unshare(paddr_t pa, struct addrspace *as, vaddr_t vaddr);
+void coremap_pcshare(paddr_t pa);
+unsigned coremap_refcount(paddr_t pa);
+unsigned coremap_nframes(void);
+void coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr);
+void coremap_clock(bool (*visit)(struct addrspace *as, vaddr_t vaddr,
+				 paddr_t pa, bool pcache, void *data),
+		   void *data);
+void coremap_printstats(void);
+
+
+#endif /* _COREMAP_H_ */
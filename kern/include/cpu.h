@@ -46,6 +46,9 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/* Number of free frames each cpu may cache. */
+#define CPU_FRAMECACHE_SIZE  16
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -60,6 +63,10 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_lastboost;		/* c_hardclocks at last priority boost */
+	unsigned c_migattempts;		/* Threads considered for migration */
+	unsigned c_migrations;		/* ...and moved to another cpu */
+	unsigned c_migsuppressed;	/* ...and kept back as cache-warm */
 
 	/*
 	 * Accessed by other cpus.
@@ -67,6 +74,9 @@ struct cpu {
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	unsigned c_runweight;		/* Total tickets on c_runqueue */
+	uint64_t c_pass;		/* Stride pass of the bottom level */
+	unsigned c_steals;		/* Threads stolen from other cpus */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -87,6 +97,19 @@ struct cpu {
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Cache of free physical frames, in front of the coremap.
+	 * Normally only used by this cpu; other cpus only drain it
+	 * when memory runs short. Protected by the frame cache lock.
+	 * See coremap.c.
+	 */
+	paddr_t c_framecache[CPU_FRAMECACHE_SIZE];
+	unsigned c_framecache_count;
+	unsigned c_framecache_hits;	/* allocations served from cache */
+	unsigned c_framecache_misses;	/* allocations that had to refill */
+	unsigned c_framecache_drains;	/* frees that had to drain */
+	struct spinlock c_framecache_lock;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -109,6 +132,16 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Access to the set of cpus, for code that keeps per-cpu state and
+ * occasionally needs to visit all of it (e.g. to print statistics).
+ *
+ * cpu_numcpus returns the number of cpus created so far; cpu_getcpu
+ * returns the cpu whose software number is INDEX.
+ */
+unsigned cpu_numcpus(void);
+struct cpu *cpu_getcpu(unsigned index);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +185,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch queues N shootdowns for one IPI; more than
+ * TLBSHOOTDOWN_MAX in all turns into a flush of the whole TLB.
+ * ipi_tlbshootdown_wait waits until a CPU has carried out all the
+ * shootdowns sent to it so far. Call it with interrupts enabled.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +203,9 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_batch(struct cpu *target,
+			    const struct tlbshootdown *mappings, unsigned n);
+void ipi_tlbshootdown_wait(struct cpu *target);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,30 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap(), munmap() and madvise(), for the kernel and
+ * for libc's <sys/mman.h>.
+ */
+
+/* Protection, for mmap's PROT argument. */
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4
+
+/* Flags: choose one of MAP_SHARED and MAP_PRIVATE, then or in MAP_ANON. */
+#define MAP_SHARED    0x1      /* Writes go to the file */
+#define MAP_PRIVATE   0x2      /* Writes are private to the process */
+#define MAP_ANON      0x1000   /* Zero-filled memory; no file */
+
+/* mmap's return value on failure. */
+#define MAP_FAILED    ((void *)-1)
+
+/* Advice, for madvise. */
+#define MADV_NORMAL      0     /* No particular pattern */
+#define MADV_RANDOM      1     /* Don't read ahead */
+#define MADV_SEQUENTIAL  2     /* Read well ahead, drop what's behind */
+#define MADV_WILLNEED    3     /* Bring it all in now */
+#define MADV_DONTNEED    4     /* Throw it away now */
+
+#endif /* _KERN_MMAN_H_ */
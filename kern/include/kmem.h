@@ -0,0 +1,58 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches for frequently allocated kernel structures.
+ *
+ * A cache hands out objects of one size. Freed objects are kept for
+ * reuse instead of going back to kmalloc: each cpu has two magazines
+ * (small stacks of objects) of its own, so most allocations and frees
+ * touch no shared state at all. When both of a cpu's magazines are
+ * empty (on alloc) or full (on free), it trades one with the cache's
+ * depot of full and empty magazines, under the cache's lock. Only when
+ * the depot has nothing to offer does the cache call kmalloc or kfree.
+ *
+ * Objects come from kmalloc, so anything kmalloc returns can be freed
+ * to a cache of its size, and a cache's objects can go to kfree once
+ * their destructor (if any) has been run on them.
+ *
+ * If a cache has a constructor, it is run once on each object when
+ * kmalloc supplies it. Objects must be in their constructed state
+ * again when freed to the cache. The destructor, if any, is run on
+ * each object the cache gives back to kfree. Objects may hold on to
+ * other memory between uses (a thread its stack, say) as long as the
+ * destructor frees it.
+ *
+ * Functions:
+ *     kmem_cache_create - make a cache of SIZE-byte objects. NAME is
+ *                         not copied. CTOR and DTOR may be NULL.
+ *                         DTOR must not call kmalloc. Returns NULL if
+ *                         out of memory. Caches are never destroyed.
+ *     kmem_cache_alloc  - get an object. Returns NULL if out of memory.
+ *     kmem_cache_free   - give back an object from kmem_cache_alloc.
+ *     kmem_reap         - free the objects held in every cache's depot
+ *                         and the current cpu's magazines; other cpus
+ *                         free theirs when they next use the cache.
+ *                         Returns the number of objects freed. Called
+ *                         through kheap_trim when memory runs short.
+ *     kmem_printstats   - print per-cache hit and miss counts.
+ */
+
+/* Objects per magazine; makes a magazine 64 bytes. */
+#define KMEM_MAGSIZE  14
+
+/* Full magazines a cache's depot may hold */
+#define KMEM_DEPOTMAX 4
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_reap(void);
+void kmem_printstats(void);
+
+
+#endif /* _KMEM_H_ */
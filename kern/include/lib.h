@@ -122,9 +122,14 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kheap_trim gives memory the heap is holding idle (object caches,
+ * large-block runs) back to the page allocator, and returns true if
+ * there was any. The VM system calls it before paging.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+bool kheap_trim(void);
 void kheap_printstats(void);
 
 /*
@@ -0,0 +1,80 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Cache of file pages, shared between processes: pages of read-only
+ * executable segments and pages of mapped files.
+ *
+ * Pages of read-only segments (text, mostly) are cached by file and
+ * offset once they have been read in, and every process running the
+ * same executable maps the same frame, so another instance of a
+ * running program costs no memory or disk I/O for its text. Pages of
+ * mmap regions are cached the same way, which is what makes writes
+ * through one MAP_SHARED mapping show through the others. The cache
+ * holds a coremap reference to each frame and a reference to its
+ * vnode; mappings hold references of their own. A cached page that
+ * only one process maps can be paged out of that process as usual,
+ * and one that no process maps any more can be reclaimed when memory
+ * runs short.
+ *
+ * A page is identified by its vnode, the file offset of the start of
+ * the page, and the range [START, END) of bytes in the page that come
+ * from the file (the rest being zero), since segments needn't cover
+ * whole pages.
+ *
+ * File systems tell the cache when a file changes underneath it, by
+ * write or truncate, with pagecache_update, and when a file's last
+ * name goes away with pagecache_invalidate. (The cache holds a vnode
+ * reference, so a vnode with cached pages is never reclaimed.)
+ *
+ * pagecache_update and pagecache_invalidate lock the pages themselves
+ * and must be called without them locked; the rest must be called
+ * with the pages locked (vm_lockpages).
+ *
+ * Functions:
+ *     pagecache_lookup    - return the frame holding the page, with a
+ *                           reference added for the caller to map it
+ *                           into AS at VADDR, or 0 if it isn't cached.
+ *     pagecache_insert    - add the frame at PA as the page. The cache
+ *                           takes a reference of its own. Fails with
+ *                           ENOMEM, leaving the frame alone, if there
+ *                           is no memory for the entry.
+ *     pagecache_reclaim   - free up to N cached pages that nobody maps,
+ *                           least recently used first. Returns the
+ *                           number freed.
+ *     pagecache_update    - the bytes [START, END) of V's file have been
+ *                           written, or cut off by truncation. Cached
+ *                           pages holding them that nobody maps are
+ *                           dropped; mapped ones are read in again.
+ *     pagecache_invalidate - drop the cached pages of V that nobody
+ *                           maps.
+ *     pagecache_printstats - print cache size and hit counts.
+ */
+
+#include "opt-dumbvm.h"
+
+struct vnode;
+struct addrspace;
+
+#if OPT_DUMBVM
+
+/* No page cache; nothing to keep up to date. */
+#define pagecache_update(v, start, end)  ((void)(v), (void)(start), (void)(end))
+#define pagecache_invalidate(v)          ((void)(v))
+
+#else
+
+paddr_t pagecache_lookup(struct vnode *v, off_t offset,
+			 unsigned start, unsigned end,
+			 struct addrspace *as, vaddr_t vaddr);
+int pagecache_insert(struct vnode *v, off_t offset,
+		      unsigned start, unsigned end, paddr_t pa);
+unsigned pagecache_reclaim(unsigned n);
+void pagecache_update(struct vnode *v, off_t start, off_t end);
+void pagecache_invalidate(struct vnode *v);
+void pagecache_printstats(void);
+
+#endif /* OPT_DUMBVM */
+
+
+#endif /* _PAGECACHE_H_ */
@@ -0,0 +1,79 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Per-address-space page table.
+ *
+ * A two-level table indexed by virtual page number: the top 10 bits
+ * of the address select a directory slot, the next 10 a PTE within
+ * that slot's leaf table. Directory and leaves are each one page.
+ * Leaves are only allocated for parts of the address space that have
+ * been touched, so a sparse address space costs little more than the
+ * pages it actually uses.
+ *
+ * PTEs are in the format of the MIPS TLBLO register, so that a resident
+ * page's PTE can be loaded into the TLB as is. The low 8 bits, which
+ * TLBLO doesn't use, are free for software flags. The UTLB refill
+ * handler in exception-mips1.S depends on this, and on struct
+ * pagetable being nothing but the directory.
+ *
+ * A page is in one of three states:
+ *
+ *    untouched - the PTE is 0; the page is filled in (from the
+ *                executable or with zeros) when it first faults.
+ *    in core   - PTE_INCORE is set and PTE_FRAME is the frame. If
+ *                PTE_VALID is clear too, the page is resident but the
+ *                pageout clock has demoted it, or fault-around brought
+ *                it in ahead of use (PTE_PREFETCH): the refill handler
+ *                leaves it to vm_fault, which notes the reference.
+ *    swapped   - PTE_SWAPPED is set and PTE_FRAME holds the swap slot
+ *                number, shifted like a frame address; or the page is
+ *                in the compressed pool, PTE_ZSWAPPED is set and
+ *                PTE_FRAME holds its zswap handle. PTE_VALID is
+ *                clear.
+ *
+ * While a page is being read in, written out or copied with the pages
+ * unlocked, PTE_BUSY is set as well; anything else that wants to
+ * change it waits until it is done (vm_pagewait).
+ *
+ * MIPS has no hardware dirty bit, so writeable pages start out mapped
+ * without PTE_WRITE; the first write faults, and vm_fault sets
+ * PTE_WRITE and PTE_DIRTY together.
+ *
+ * Functions:
+ *     pt_create  - allocate an empty page table. Returns NULL on error.
+ *     pt_destroy - free the table itself. Frames its PTEs point to are
+ *                  the caller's business.
+ *     pt_lookup  - return a pointer to the PTE for VADDR. If there is
+ *                  no leaf table covering VADDR, allocate one if CREATE
+ *                  is set and return NULL otherwise (or on out of
+ *                  memory).
+ */
+
+#define PT_NENTRIES   1024			/* entries per table */
+#define PT_L1INDEX(va) ((va) >> 22)
+#define PT_L2INDEX(va) (((va) >> 12) & (PT_NENTRIES - 1))
+
+#define PTE_FRAME     0xfffff000	/* physical frame of the page */
+#define PTE_WRITE     0x00000400	/* writes allowed (TLBLO_DIRTY) */
+#define PTE_VALID     0x00000200	/* may be loaded into the TLB (TLBLO_VALID) */
+#define PTE_SWBITS    0x000000ff	/* software flags; not loaded into TLB */
+#define PTE_INCORE    0x00000001	/* resident at PTE_FRAME */
+#define PTE_SWAPPED   0x00000002	/* in swap; PTE_FRAME is the slot */
+#define PTE_DIRTY     0x00000004	/* written since it was last clean */
+#define PTE_ZSWAPPED  0x00000008	/* compressed; PTE_FRAME is the handle */
+#define PTE_PREFETCH  0x00000010	/* prefetched and not yet touched */
+#define PTE_BUSY      0x00000020	/* in use with the pages unlocked */
+
+#define PTE_SLOT(pte)     ((pte) >> 12)
+#define PTE_MKSLOT(slot)  (((uint32_t)(slot) << 12) | PTE_SWAPPED)
+#define PTE_MKZSLOT(h)    (((uint32_t)(h) << 12) | PTE_ZSWAPPED)
+
+struct pagetable;  /* Opaque. */
+
+struct pagetable *pt_create(void);
+void              pt_destroy(struct pagetable *pt);
+uint32_t         *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -59,6 +59,9 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
+	/* Scheduling */
+	unsigned p_tickets;		/* stride tickets; 0 for default class */
+
 #ifdef UW
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
@@ -0,0 +1,44 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for the paged VM system.
+ *
+ * Pages are swapped to a raw disk device, SWAP_DEVICE, divided into
+ * page-sized slots. A bitmap records which slots are in use. Slots
+ * are handed out next-fit, so that pages evicted together usually
+ * land next to each other and can be written with a single I/O. A
+ * slot can be named by more than one PTE (as_copy shares swapped-out
+ * pages rather than reading them in), so each has a reference count.
+ *
+ * If the device can't be opened at boot, paging is disabled and
+ * swap_alloc always fails.
+ *
+ * Functions:
+ *     swap_bootstrap - open the swap device. Called from vm_bootstrap.
+ *     swap_alloc     - allocate a run of up to NSLOTS contiguous slots.
+ *                      Returns the number allocated, and the first in
+ *                      *SLOT, or 0 if swap is full.
+ *     swap_share     - add a reference to slot SLOT.
+ *     swap_free      - drop a reference to slot SLOT, releasing it when
+ *                      the last goes.
+ *     swap_in        - read slot SLOT into the frame at PA.
+ *     swap_out       - write the NPAGES frames at PAS to consecutive
+ *                      slots starting at SLOT. NPAGES must not exceed
+ *                      SWAP_MAXCLUSTER.
+ *     swap_printstats - print swap space usage.
+ */
+
+#define SWAP_DEVICE      "lhd1raw:"
+#define SWAP_MAXCLUSTER  16
+
+void swap_bootstrap(void);
+unsigned swap_alloc(unsigned nslots, unsigned *slot);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+int swap_in(unsigned slot, paddr_t pa);
+int swap_out(unsigned slot, const paddr_t *pas, unsigned npages);
+void swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
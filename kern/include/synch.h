@@ -50,6 +50,12 @@ struct semaphore {
         volatile int sem_count;
 };
 
+/*
+ * Set up the caches semaphores and locks are allocated from. Call
+ * once during system startup, before creating any.
+ */
+void synch_bootstrap(void);
+
 struct semaphore *sem_create(const char *name, int initial_count);
 void sem_destroy(struct semaphore *);
 
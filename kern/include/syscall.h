@@ -63,6 +63,11 @@ int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_settickets(int tickets);
 
 #endif // UW
 
@@ -57,6 +57,8 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadtest4(int, char **);
+int threadtest5(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
@@ -76,9 +78,14 @@ int writestress2(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
 
+/* vm tests (not with dumbvm) */
+int mmaptest(int, char **);
+int cowtest(int, char **);
+
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbig(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
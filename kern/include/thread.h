@@ -55,6 +55,19 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/* Names shorter than this are kept in the thread itself */
+#define THREAD_NAMEBUF 24
+
+/* Number of scheduling priority levels; 0 is the highest */
+#define THREAD_NPRI 4
+
+/*
+ * Stride scheduling tickets: the most a process may have, and what
+ * threads in the default (MLFQ) class count as.
+ */
+#define THREAD_MAXTICKETS  1000
+#define THREAD_DEFTICKETS  100
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -71,6 +84,7 @@ struct thread {
 	 * debugger is messed up.
 	 */
 	char *t_name;			/* Name of this thread */
+	char t_namebuf[THREAD_NAMEBUF];	/* t_name, if it fits */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
 
@@ -84,6 +98,26 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduling state; see schedule() in thread.c. Changed only
+	 * by the thread's own cpu, or with the run queue it is on locked.
+	 */
+	unsigned t_priority;		/* Current level, 0..THREAD_NPRI-1 */
+	unsigned t_ticks;		/* Hardclocks used of this quantum */
+	unsigned t_tickets;		/* Stride tickets; 0 for MLFQ class */
+	uint64_t t_pass;		/* Stride pass, at the bottom level */
+
+	/*
+	 * Cache affinity, for the migration cost model. Times are in
+	 * hardclocks of the cpu the thread last ran on.
+	 */
+	struct cpu *t_lastcpu;		/* CPU thread last ran on */
+	unsigned t_lastrun;		/* When it last stopped running */
+	unsigned t_runstart;		/* When it last started running */
+	unsigned t_lastslice;		/* Hardclocks it ran for last time */
+	unsigned t_tlbfaults;		/* TLB refills taken this time */
+	unsigned t_lastfaults;		/* TLB refills taken last time */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -157,6 +191,13 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for a clock tick, and switch to another
+ * thread if its quantum is used up or a higher-priority thread is
+ * waiting. Called from the timer interrupt.
+ */
+void thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -168,5 +209,24 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * Put the current thread in the stride class with TICKETS tickets, or
+ * back in the default class if TICKETS is 0.
+ */
+void thread_settickets(unsigned tickets);
+
+/*
+ * Print each cpu's current thread and run queue, with priorities.
+ */
+void thread_printsched(void);
+
+/*
+ * Migration cost model (see thread_consider_migration): set the
+ * tunable called NAME, or print the tunables and migration counts.
+ * thread_setmigtunable returns EINVAL if there is no such tunable.
+ */
+int thread_setmigtunable(const char *name, unsigned value);
+void thread_printmigration(void);
+
 
 #endif /* _THREAD_H_ */
@@ -36,7 +36,19 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_TLB_FLUSH_AVOIDED     (10)
+#define VMSTAT_PAGE_FAULT_ZSWAP      (11)
+#define VMSTAT_ZSWAP_STORE           (12)
+#define VMSTAT_ZSWAP_BYTES           (13)
+#define VMSTAT_ZSWAP_REJECT          (14)
+#define VMSTAT_ZSWAP_SPILL           (15)
+#define VMSTAT_PAGE_FAULT_CACHED     (16)
+#define VMSTAT_PREFETCH              (17)
+#define VMSTAT_PREFETCH_USED         (18)
+#define VMSTAT_SHOOTDOWN_IPI         (19)
+#define VMSTAT_SHOOTDOWN_SKIPPED     (20)
+#define VMSTAT_MAPPED_FILE_READ      (21)
+#define VMSTAT_COUNT                 (22)
 
 /* ----------------------------------------------------------------------- */
 
@@ -52,6 +64,10 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Add N to the specified count (for counts of bytes rather than events) */
+void vmstats_add(unsigned int index, unsigned int n);    /* uses locking */
+void _vmstats_add(unsigned int index, unsigned int n);   /* atomicity must be ensured elsewhere */
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
@@ -55,6 +55,62 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * TLB replacement policy, for the paged VM (not dumbvm). See vm.c.
+ */
+#define TLBPOLICY_RR         0    /* round-robin */
+#define TLBPOLICY_RANDOM     1    /* hardware random slot */
+#define TLBPOLICY_NRU        2    /* not-recently-used approximation */
+
+int vm_gettlbpolicy(void);
+void vm_settlbpolicy(int policy);
+
+/*
+ * Make AS the one the TLB matches against and the UTLB refill handler
+ * walks; or, for deactivate, make sure no cpu refills from it any
+ * more (paged VM).
+ */
+struct addrspace;
+void vm_tlbactivate(struct addrspace *as);
+void vm_tlbdeactivate(struct addrspace *as);
+
+/* Discard all of AS's TLB entries on every cpu (paged VM) */
+void vm_tlbinvalidate(struct addrspace *as);
+
+/*
+ * Number of TLB refills of resident pages this cpu has done since the
+ * last call; the scheduler charges them to the thread that was running.
+ */
+unsigned vm_tlbrefills(void);
+
+/*
+ * Lock out pageout while changing page tables or frame sharing; wait
+ * for some PTE_BUSY page to be done with, or mark one done with; and
+ * allocate a user frame for AS at VADDR, zero-filled if ZERO, paging
+ * something out if memory is full (paged VM). vm_allocframe returns 0
+ * if nothing can be paged out. Call vm_pagewait and vm_allocframe
+ * with the pages locked; both may unlock them for a while.
+ */
+void vm_lockpages(void);
+void vm_unlockpages(void);
+void vm_pagewait(void);
+void vm_pageunbusy(uint32_t *pte);
+paddr_t vm_allocframe(struct addrspace *as, vaddr_t vaddr, bool zero);
+
+/* Map AS's read-only pages that are in the page cache (paged VM) */
+void vm_premap(struct addrspace *as);
+
+/*
+ * Write the page at VADDR in MAP_SHARED region RG, held in frame
+ * PADDR, back to the file, as far as the file goes (paged VM).
+ */
+struct region;
+int vm_writeback(struct region *rg, vaddr_t vaddr, paddr_t paddr);
+
+/* Page in NPAGES pages of RG from VADDR on, ahead of use (paged VM) */
+void vm_prefetch(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+		 size_t npages);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
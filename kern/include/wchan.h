@@ -37,6 +37,12 @@
 
 struct wchan; /* Opaque */
 
+/*
+ * Set up the cache wait channels are allocated from. Call once during
+ * system startup, before anything creates a wait channel.
+ */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -0,0 +1,45 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed in-memory swap, in front of the swap device.
+ *
+ * Dirty pages being paged out are compressed into a fixed pool of
+ * kernel memory, set aside at boot, instead of going straight to
+ * disk. Bringing one back in then costs a decompression rather than
+ * eight sector reads. Pages that don't compress to at most
+ * ZSWAP_MAXSIZE bytes go to the swap device as before. When the pool
+ * is full, the pages that have been in it longest are spilled to the
+ * swap device to make room.
+ *
+ * A stored page is named by a handle, which the owner's PTE holds in
+ * place of a frame number (see pagetable.h). All of these must be
+ * called with the pages locked (vm_lockpages). zswap_store unlocks
+ * them while it spills a page to the swap device; the spilled page's
+ * PTE is PTE_BUSY meanwhile.
+ *
+ * Functions:
+ *     zswap_bootstrap  - set up the pool. Called from vm_bootstrap.
+ *     zswap_store      - compress the frame at PA, which AS maps at
+ *                        VADDR, into the pool; return its handle in
+ *                        *HANDLE. Fails with E2BIG if the page doesn't
+ *                        compress well enough, or ENOSPC if there is no
+ *                        room and none can be made.
+ *     zswap_load       - decompress page HANDLE into the frame at PA.
+ *     zswap_free       - discard page HANDLE.
+ *     zswap_printstats - print pool usage.
+ */
+
+#define ZSWAP_MAXSIZE  (PAGE_SIZE / 2)
+
+struct addrspace;
+
+void zswap_bootstrap(void);
+int zswap_store(paddr_t pa, struct addrspace *as, vaddr_t vaddr,
+		unsigned *handle);
+void zswap_load(unsigned handle, paddr_t pa);
+void zswap_free(unsigned handle);
+void zswap_printstats(void);
+
+
+#endif /* _ZSWAP_H_ */
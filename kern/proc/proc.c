@@ -49,6 +49,7 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <kmem.h>
 #include <kern/fcntl.h>  
 
 /*
@@ -69,7 +70,8 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;   
 #endif  // UW
 
-
+/* Object cache for proc structures. */
+static struct kmem_cache *proc_cache;
 
 /*
  * Create a proc structure.
@@ -80,13 +82,13 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
@@ -99,6 +101,9 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
+	/* Scheduling fields */
+	proc->p_tickets = 0;
+
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
@@ -167,7 +172,7 @@ proc_destroy(struct proc *proc)
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -193,6 +198,10 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc), NULL, NULL);
+  if (proc_cache == NULL) {
+    panic("could not create proc cache\n");
+  }
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -42,6 +42,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
@@ -49,6 +50,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -107,6 +109,8 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	wchan_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -151,6 +155,8 @@ shutdown(void)
 	vfs_clearcurdir();
 	vfs_unmountall();
 
+	vmstats_print();
+
 	thread_shutdown();
 
 	splhigh();
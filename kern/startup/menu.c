@@ -42,7 +42,15 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <coremap.h>
+#include <kmem.h>
+#include <swap.h>
+#include <zswap.h>
+#include <pagecache.h>
+#include <addrspace.h>
+#include <vm.h>
 #include "opt-synchprobs.h"
+#include "opt-dumbvm.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 
@@ -392,10 +400,135 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_printstats();
 	
 	return 0;
 }
 
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+#if !OPT_DUMBVM
+	swap_printstats();
+	zswap_printstats();
+	pagecache_printstats();
+#endif
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printsched();
+
+	return 0;
+}
+
+/*
+ * Command for showing or setting the migration cost model tunables.
+ */
+static
+int
+cmd_migration(int nargs, char **args)
+{
+	if (nargs == 1) {
+		thread_printmigration();
+		return 0;
+	}
+	if (nargs != 3) {
+		kprintf("Usage: mig [tunable value]\n");
+		return EINVAL;
+	}
+	if (thread_setmigtunable(args[1], atoi(args[2]))) {
+		kprintf("Unknown migration tunable %s\n", args[1]);
+		return EINVAL;
+	}
+	return 0;
+}
+
+#if !OPT_DUMBVM
+
+/*
+ * Command for showing or setting the TLB replacement policy.
+ */
+
+static const struct {
+	const char *name;
+	int policy;
+} tlbpolicies[] = {
+	{ "rr",		TLBPOLICY_RR },
+	{ "random",	TLBPOLICY_RANDOM },
+	{ "nru",	TLBPOLICY_NRU },
+	{ NULL, 0 }
+};
+
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	int i;
+
+	if (nargs == 1) {
+		for (i=0; tlbpolicies[i].name; i++) {
+			if (tlbpolicies[i].policy == vm_gettlbpolicy()) {
+				kprintf("TLB replacement policy: %s\n",
+					tlbpolicies[i].name);
+			}
+		}
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: tlb [rr|random|nru]\n");
+		return EINVAL;
+	}
+
+	for (i=0; tlbpolicies[i].name; i++) {
+		if (!strcmp(tlbpolicies[i].name, args[1])) {
+			vm_settlbpolicy(tlbpolicies[i].policy);
+			return 0;
+		}
+	}
+	kprintf("Unknown TLB policy %s\n", args[1]);
+	return EINVAL;
+}
+
+/*
+ * Command for showing or setting the user stack size limit.
+ */
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kprintf("User stack limit: %u pages\n", as_getstacklimit());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: stk [pages]\n");
+		return EINVAL;
+	}
+
+	result = as_setstacklimit(atoi(args[1]));
+	if (result) {
+		kprintf("stk: %s\n", strerror(result));
+	}
+	return result;
+}
+
+#endif /* !OPT_DUMBVM */
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -456,9 +589,12 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc large-block test      ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Thread fork/exit timing       ",
+	"[tt5] Stride ticket shares          ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -474,6 +610,10 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+#if !OPT_DUMBVM
+	"[mm1] mmap shared writeback (4)     ",
+	"[cow1] Copy-on-write as_copy        ",
+#endif
 	NULL
 };
 
@@ -505,6 +645,13 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[cm] Physical memory stats          ",
+	"[sched] Thread priorities           ",
+	"[mig] Migration cost model          ",
+#if !OPT_DUMBVM
+	"[tlb] TLB replacement policy        ",
+	"[stk] User stack size limit         ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -561,18 +708,28 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "cm",         cmd_coremapstats },
+	{ "sched",      cmd_schedstats },
+	{ "mig",        cmd_migration },
+#if !OPT_DUMBVM
+	{ "tlb",        cmd_tlbpolicy },
+	{ "stk",        cmd_stacklimit },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbig },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadtest4 },
+	{ "tt5",	threadtest5 },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
@@ -589,6 +746,12 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+#if !OPT_DUMBVM
+
+	/* vm tests */
+	{ "mm1",	mmaptest },
+	{ "cow1",	cowtest },
+#endif
 
 	{ NULL, NULL }
 };
@@ -0,0 +1,116 @@
+/*
+ * mmap, munmap and madvise. The address space does the work; see
+ * as_map, as_unmap and as_advise, and vm.c for how mapped pages are
+ * brought in.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <syscall.h>
+#include <vnode.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+
+/*
+ * Find the vnode open as file handle FD.
+ *
+ * n.b. There is no file table yet, so the only descriptors are the
+ * console ones that sys_write knows about. The console can't be
+ * mapped (VOP_MMAP says so), but anything that gets a file table can
+ * look its vnodes up here. Until then, mapping files is exercised
+ * from the kernel menu (mm1, in test/mmaptest.c).
+ */
+static
+int
+mmap_getvnode(int fd, struct vnode **ret)
+{
+	if (fd != STDIN_FILENO && fd != STDOUT_FILENO &&
+	    fd != STDERR_FILENO) {
+		return EBADF;
+	}
+	KASSERT(curproc->console != NULL);
+	*ret = curproc->console;
+	return 0;
+}
+
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	int perms, rgflags;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: mmap(%x,%u,%d,%x,%d)\n",
+	      (unsigned)addr, len, prot, flags, fd);
+
+	/* ADDR is only a hint, and we don't take hints. */
+	(void)addr;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	switch (flags & ~MAP_ANON) {
+	    case MAP_SHARED:
+	    case MAP_PRIVATE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	perms = 0;
+	if (prot & PROT_READ) {
+		perms |= RG_READ;
+	}
+	if (prot & PROT_WRITE) {
+		perms |= RG_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		perms |= RG_EXEC;
+	}
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	if (flags & MAP_ANON) {
+		if (flags & MAP_SHARED) {
+			/* Without fork there is nobody to share it with. */
+			return EINVAL;
+		}
+		return as_map(as, len, perms, 0, NULL, 0, retval);
+	}
+
+	result = mmap_getvnode(fd, &v);
+	if (result) {
+		return result;
+	}
+	result = VOP_MMAP(v);
+	if (result) {
+		return result == EUNIMP ? ENODEV : result;
+	}
+
+	rgflags = (flags & MAP_SHARED) ? RG_SHARED : 0;
+	return as_map(as, len, perms, rgflags, v, offset, retval);
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	DEBUG(DB_SYSCALL, "Syscall: munmap(%x,%u)\n", (unsigned)addr, len);
+
+	return as_unmap(curproc_getas(), (vaddr_t)addr, len);
+}
+
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	DEBUG(DB_SYSCALL, "Syscall: madvise(%x,%u,%d)\n",
+	      (unsigned)addr, len, advice);
+
+	return as_advise(curproc_getas(), (vaddr_t)addr, len, advice);
+}
@@ -92,3 +92,25 @@ sys_waitpid(pid_t pid,
   return(0);
 }
 
+
+/*
+ * settickets: put the process in the stride scheduling class with
+ * TICKETS tickets, or back in the default class if TICKETS is 0. See
+ * schedule() in thread.c.
+ */
+int
+sys_settickets(int tickets)
+{
+  struct proc *p = curproc;
+
+  if (tickets < 0 || tickets > THREAD_MAXTICKETS) {
+    return EINVAL;
+  }
+
+  spinlock_acquire(&p->p_lock);
+  p->p_tickets = tickets;
+  spinlock_release(&p->p_lock);
+
+  thread_settickets(tickets);
+  return(0);
+}
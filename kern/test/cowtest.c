@@ -0,0 +1,204 @@
+/*
+ * Copy-on-write test: fill an address space, as_copy it, write to
+ * some pages through each copy, and check that each side sees only
+ * its own writes and that the frames they shared end up unshared.
+ *
+ * There is no fork yet, so nothing else calls as_copy. Like mm1, this
+ * runs in the kernel, switching the menu thread's process between
+ * the two address spaces and touching them with copyin/copyout.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <copyinout.h>
+#include <test.h>
+
+#define COW_NPAGES  8
+
+static char cow_buf[PAGE_SIZE];
+
+/*
+ * Byte POS of page PAGE of the test pattern for SEED.
+ */
+static
+char
+cow_pattern(unsigned page, size_t pos, unsigned seed)
+{
+	return (char)((page * 31 + pos + seed * 7) & 0xff);
+}
+
+/*
+ * Write page PAGE at VADDR in the current address space with the
+ * pattern for SEED, or check that it holds it.
+ */
+static
+int
+cow_page(vaddr_t vaddr, unsigned page, bool write, unsigned seed)
+{
+	userptr_t p = (userptr_t)(vaddr + page * PAGE_SIZE);
+	size_t i;
+	int result;
+
+	if (write) {
+		for (i=0; i<PAGE_SIZE; i++) {
+			cow_buf[i] = cow_pattern(page, i, seed);
+		}
+		return copyout(cow_buf, p, PAGE_SIZE);
+	}
+
+	result = copyin((const_userptr_t)p, cow_buf, PAGE_SIZE);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<PAGE_SIZE; i++) {
+		if (cow_buf[i] != cow_pattern(page, i, seed)) {
+			kprintf("cowtest: page %u byte %u is wrong (seed %u)\n",
+				page, (unsigned)i, seed);
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Switch the current process to AS.
+ */
+static
+void
+cow_switch(struct addrspace *as)
+{
+	curproc_setas(as);
+	as_activate();
+}
+
+/*
+ * Count AS's pages at VADDR whose frames are shared. The number that
+ * are in core at all goes in *NINCORE.
+ */
+static
+unsigned
+cow_nshared(struct addrspace *as, vaddr_t vaddr, unsigned *nincore)
+{
+	uint32_t *pte;
+	unsigned i, n;
+
+	n = *nincore = 0;
+	vm_lockpages();
+	for (i=0; i<COW_NPAGES; i++) {
+		pte = pt_lookup(as->as_pt, vaddr + i * PAGE_SIZE, false);
+		if (pte == NULL || !(*pte & PTE_INCORE)) {
+			/* Paged out; nothing to see. */
+			continue;
+		}
+		(*nincore)++;
+		if (coremap_refcount(*pte & PTE_FRAME) > 1) {
+			n++;
+		}
+	}
+	vm_unlockpages();
+	return n;
+}
+
+int
+cowtest(int nargs, char **args)
+{
+	struct addrspace *as, *copy, *oldas;
+	vaddr_t vaddr;
+	unsigned i, nshared, nincore, n;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting copy-on-write test...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		kprintf("cowtest: as_create: Out of memory\n");
+		return ENOMEM;
+	}
+	copy = NULL;
+	oldas = curproc_setas(as);
+	as_activate();
+
+	result = as_map(as, COW_NPAGES * PAGE_SIZE, RG_READ | RG_WRITE, 0,
+			NULL, 0, &vaddr);
+	if (result) {
+		kprintf("cowtest: as_map: %s\n", strerror(result));
+		goto out;
+	}
+	for (i=0; i<COW_NPAGES; i++) {
+		result = cow_page(vaddr, i, true, 1);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	result = as_copy(as, &copy);
+	if (result) {
+		kprintf("cowtest: as_copy: %s\n", strerror(result));
+		goto out;
+	}
+	nshared = cow_nshared(as, vaddr, &nincore);
+	if (nshared != nincore) {
+		kprintf("cowtest: only %u of %u resident pages shared\n",
+			nshared, nincore);
+		result = EINVAL;
+		goto out;
+	}
+
+	/* The original writes the even pages; the copy the odd ones. */
+	for (i=0; i<COW_NPAGES; i+=2) {
+		result = cow_page(vaddr, i, true, 2);
+		if (result) {
+			goto fail;
+		}
+	}
+	cow_switch(copy);
+	for (i=0; i<COW_NPAGES; i++) {
+		result = cow_page(vaddr, i, i % 2 == 1, i % 2 == 1 ? 3 : 1);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	/* Each side sees its own writes and the other's old data. */
+	for (i=0; i<COW_NPAGES; i++) {
+		result = cow_page(vaddr, i, false, i % 2 == 1 ? 3 : 1);
+		if (result) {
+			goto fail;
+		}
+	}
+	cow_switch(as);
+	for (i=0; i<COW_NPAGES; i++) {
+		result = cow_page(vaddr, i, false, i % 2 == 0 ? 2 : 1);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	/* Every shared page has been written on one side or the other. */
+	nshared = cow_nshared(as, vaddr, &n) + cow_nshared(copy, vaddr, &n);
+	if (nshared > 0) {
+		kprintf("cowtest: %u frames still shared\n", nshared);
+		result = EINVAL;
+	}
+	goto out;
+
+ fail:
+	kprintf("cowtest: %s\n", strerror(result));
+ out:
+	cow_switch(oldas);
+	if (copy != NULL) {
+		as_destroy(copy);
+	}
+	as_destroy(as);
+	kprintf("Copy-on-write test %s.\n", result ? "failed" : "done");
+	return result;
+}
@@ -137,3 +137,59 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Test the large-block sizes: allocate a mix of blocks in the 3K, 6K
+ * and 12K classes, fill each with its own pattern, check them all,
+ * and free every other one before the rest so that buddies merge
+ * from both sides.
+ */
+
+#define NBIG 24
+
+static const size_t bigsizes[] = { 2500, 3072, 5000, 6144, 10000, 12288 };
+#define NBIGSIZES (sizeof(bigsizes) / sizeof(bigsizes[0]))
+
+int
+mallocbig(int nargs, char **args)
+{
+	unsigned char *ptrs[NBIG];
+	size_t i, j, n;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmalloc large-block test...\n");
+
+	for (n=0; n<NBIG; n++) {
+		ptrs[n] = kmalloc(bigsizes[n % NBIGSIZES]);
+		if (ptrs[n] == NULL) {
+			kprintf("mallocbig: kmalloc of %lu bytes failed\n",
+				(unsigned long)bigsizes[n % NBIGSIZES]);
+			break;
+		}
+		for (j=0; j<bigsizes[n % NBIGSIZES]; j++) {
+			ptrs[n][j] = (unsigned char)n;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		for (j=0; j<bigsizes[i % NBIGSIZES]; j++) {
+			if (ptrs[i][j] != (unsigned char)i) {
+				panic("mallocbig: block %lu overwritten at %lu\n",
+				      (unsigned long)i, (unsigned long)j);
+			}
+		}
+	}
+
+	for (i=1; i<n; i+=2) {
+		kfree(ptrs[i]);
+	}
+	for (i=0; i<n; i+=2) {
+		kfree(ptrs[i]);
+	}
+
+	kprintf("kmalloc large-block test done\n");
+
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * mmap test: map a file MAP_SHARED, check that the mapping shows what
+ * is in the file, write through it, unmap it, and check that the file
+ * got the writes.
+ *
+ * There is no open() for user programs yet, so this runs in the
+ * kernel: it gives the menu thread's process an address space of its
+ * own for the duration and touches the mapping with copyin/copyout,
+ * which fault pages in the same way user accesses do.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <test.h>
+
+#define MMT_FILENAME  "mmaptest.dat"
+#define MMT_LEN       (2 * PAGE_SIZE + 100)	/* ends partway into a page */
+#define MMT_CHUNK     256
+
+static char mmt_buf[MMT_CHUNK];
+
+/*
+ * Byte POS of the test pattern for SEED.
+ */
+static
+char
+mmt_pattern(size_t pos, unsigned seed)
+{
+	return (char)((pos * 7 + pos / 251 + seed) & 0xff);
+}
+
+static
+void
+mmt_fill(size_t pos, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		mmt_buf[i] = mmt_pattern(pos + i, seed);
+	}
+}
+
+/*
+ * Check mmt_buf against the pattern; returns the offset of the first
+ * bad byte, or -1.
+ */
+static
+long
+mmt_check(size_t pos, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (mmt_buf[i] != mmt_pattern(pos + i, seed)) {
+			return pos + i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Read or write the whole file with the pattern for SEED, checking
+ * what is read.
+ */
+static
+int
+mmt_fileio(struct vnode *v, enum uio_rw rw, unsigned seed)
+{
+	struct iovec iov;
+	struct uio ku;
+	size_t pos, len;
+	long bad;
+	int result;
+
+	for (pos = 0; pos < MMT_LEN; pos += len) {
+		len = MMT_LEN - pos < MMT_CHUNK ? MMT_LEN - pos : MMT_CHUNK;
+		if (rw == UIO_WRITE) {
+			mmt_fill(pos, len, seed);
+		}
+		uio_kinit(&iov, &ku, mmt_buf, len, pos, rw);
+		result = rw == UIO_WRITE ? VOP_WRITE(v, &ku) : VOP_READ(v, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			return EIO;
+		}
+		if (rw == UIO_READ) {
+			bad = mmt_check(pos, len, seed);
+			if (bad >= 0) {
+				kprintf("mmaptest: file byte %ld is wrong\n",
+					bad);
+				return EINVAL;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * The same through the mapping at VADDR.
+ */
+static
+int
+mmt_mapio(vaddr_t vaddr, enum uio_rw rw, unsigned seed)
+{
+	size_t pos, len;
+	long bad;
+	int result;
+
+	for (pos = 0; pos < MMT_LEN; pos += len) {
+		len = MMT_LEN - pos < MMT_CHUNK ? MMT_LEN - pos : MMT_CHUNK;
+		if (rw == UIO_WRITE) {
+			mmt_fill(pos, len, seed);
+			result = copyout(mmt_buf, (userptr_t)(vaddr + pos),
+					 len);
+		}
+		else {
+			result = copyin((const_userptr_t)(vaddr + pos),
+					mmt_buf, len);
+		}
+		if (result) {
+			return result;
+		}
+		if (rw == UIO_READ) {
+			bad = mmt_check(pos, len, seed);
+			if (bad >= 0) {
+				kprintf("mmaptest: mapped byte %ld is wrong\n",
+					bad);
+				return EINVAL;
+			}
+		}
+	}
+	return 0;
+}
+
+int
+mmaptest(int nargs, char **args)
+{
+	char name[32], buf[32];
+	struct vnode *v;
+	struct addrspace *as, *oldas;
+	vaddr_t vaddr;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: mm1 filesystem\n");
+		return EINVAL;
+	}
+	snprintf(name, sizeof(name), "%s%s%s", args[1],
+		 args[1][strlen(args[1]) - 1] == ':' ? "" : ":",
+		 MMT_FILENAME);
+
+	kprintf("Starting mmap test...\n");
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	result = vfs_open(buf, O_RDWR|O_CREAT|O_TRUNC, 0664, &v);
+	if (result) {
+		kprintf("mmaptest: %s: %s\n", name, strerror(result));
+		return result;
+	}
+	result = mmt_fileio(v, UIO_WRITE, 1);
+	if (result) {
+		kprintf("mmaptest: writing %s: %s\n", name, strerror(result));
+		goto out;
+	}
+	result = VOP_MMAP(v);
+	if (result) {
+		kprintf("mmaptest: %s can't be mapped: %s\n", name,
+			strerror(result));
+		goto out;
+	}
+
+	as = as_create();
+	if (as == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+	oldas = curproc_setas(as);
+	as_activate();
+
+	result = as_map(as, MMT_LEN, RG_READ | RG_WRITE, RG_SHARED, v, 0,
+			&vaddr);
+	if (result) {
+		kprintf("mmaptest: as_map: %s\n", strerror(result));
+		goto unset;
+	}
+	result = mmt_mapio(vaddr, UIO_READ, 1);
+	if (result) {
+		kprintf("mmaptest: reading the mapping: %s\n",
+			strerror(result));
+		goto unset;
+	}
+	result = mmt_mapio(vaddr, UIO_WRITE, 2);
+	if (result) {
+		kprintf("mmaptest: writing the mapping: %s\n",
+			strerror(result));
+		goto unset;
+	}
+	result = as_unmap(as, vaddr, MMT_LEN);
+	if (result) {
+		kprintf("mmaptest: as_unmap: %s\n", strerror(result));
+		goto unset;
+	}
+
+	result = mmt_fileio(v, UIO_READ, 2);
+	if (result) {
+		kprintf("mmaptest: reading back %s: %s\n", name,
+			strerror(result));
+	}
+
+ unset:
+	curproc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+ out:
+	vfs_close(v);
+	strcpy(buf, name);
+	vfs_remove(buf);
+	kprintf("mmap test %s.\n", result ? "failed" : "done");
+	return result;
+}
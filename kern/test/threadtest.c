@@ -32,11 +32,17 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <test.h>
 
 #define NTHREADS  8
+#define NFORKS    1000
+#define NHOGS     3
+#define HOGSECS   10	/* how long the hogs compete for */
+#define HOGCHUNK  1000	/* loop iterations in a unit of work */
 
 static struct semaphore *tsem = NULL;
 
@@ -144,3 +150,140 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+static
+void
+forkexitthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(tsem);
+}
+
+/*
+ * Time thread_fork and thread_exit: fork NFORKS threads that exit
+ * at once, one at a time, waiting for each before forking the next.
+ */
+int
+threadtest4(int nargs, char **args)
+{
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	unsigned long us;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting thread test 4...\n");
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NFORKS; i++) {
+		result = thread_fork("forkexit", NULL, forkexitthread,
+				     NULL, i);
+		if (result) {
+			panic("threadtest4: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+		P(tsem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+	us = (unsigned long)rsecs * 1000000 + rnsecs / 1000;
+	kprintf("%d fork/exit round trips in %lu.%09lu seconds "
+		"(%lu us each)\n", NFORKS, (unsigned long)rsecs,
+		(unsigned long)rnsecs, us / NFORKS);
+	kprintf("Thread test 4 done.\n");
+
+	return 0;
+}
+
+static const unsigned hogtickets[NHOGS] = { 100, 200, 400 };
+static volatile unsigned long hogwork[NHOGS];
+static time_t hogend;
+
+/*
+ * Spin with the given share of tickets until hogend, counting units
+ * of work done.
+ */
+static
+void
+hogthread(void *junk, unsigned long num)
+{
+	volatile int j;
+	unsigned long work;
+	time_t now;
+	uint32_t nsecs;
+
+	(void)junk;
+
+	thread_settickets(hogtickets[num]);
+
+	work = 0;
+	do {
+		for (j=0; j<HOGCHUNK; j++) {
+			/* spin */
+		}
+		work++;
+		gettime(&now, &nsecs);
+	} while (now < hogend);
+
+	hogwork[num] = work;
+	V(tsem);
+}
+
+/*
+ * Stride scheduling: run NHOGS cpu-bound threads side by side with
+ * 1:2:4 tickets and print how much work each got done relative to
+ * the first. Tickets only divide a cpu among the threads queued on
+ * it, so the ratios come out near 1:2:4 only on a single cpu.
+ */
+int
+threadtest5(int nargs, char **args)
+{
+	uint32_t nsecs;
+	unsigned long ratio;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting thread test 5...\n");
+	if (cpu_numcpus() > 1) {
+		kprintf("Warning: %u cpus; the hogs may not share one, and "
+			"the ratios will be flatter\n", cpu_numcpus());
+	}
+
+	gettime(&hogend, &nsecs);
+	hogend += HOGSECS;
+
+	for (i=0; i<NHOGS; i++) {
+		result = thread_fork("hog", NULL, hogthread, NULL, i);
+		if (result) {
+			panic("threadtest5: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NHOGS; i++) {
+		P(tsem);
+	}
+
+	if (hogwork[0] == 0) {
+		kprintf("Hog 0 got no work done\n");
+		return 0;
+	}
+	for (i=0; i<NHOGS; i++) {
+		ratio = hogwork[i] * 100 / hogwork[0];
+		kprintf("hog %d: %u tickets, %lu units, %lu.%02lu times "
+			"hog 0 (expected %u.00)\n", i, hogtickets[i],
+			hogwork[i], ratio / 100, ratio % 100,
+			hogtickets[i] / hogtickets[0]);
+	}
+	kprintf("Thread test 5 done.\n");
+
+	return 0;
+}
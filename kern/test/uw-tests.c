@@ -208,17 +208,28 @@ vmstats_thread(void *junk, unsigned long num)
             break;
 
           case VMSTAT_TLB_RELOAD:
-            vmstats_inc(j);
+            if (i % 2 == 0) {
+               vmstats_inc(j);
+            }
             break;
 
-          /* VMSTAT_TLB_FAULT = VMSTAT_TLB_RELOAD + VMSTAT_PAGE_FAULT_DISK + VMSTAT_SWAP_FILE_ZERO */
+          /* VMSTAT_TLB_FAULT + VMSTAT_PREFETCH
+           *    = VMSTAT_TLB_RELOAD + VMSTAT_PAGE_FAULT_DISK + VMSTAT_SWAP_FILE_ZERO
+           *      + VMSTAT_PAGE_FAULT_ZSWAP + VMSTAT_PAGE_FAULT_CACHED */
           case VMSTAT_PAGE_FAULT_ZERO:
             if (i % 2 == 0) {
                vmstats_inc(j);
             }
             break;
 
-          /* VMSTAT_PAGE_FAULT_DISK = VMSTAT_ELF_FILE_READ + VMSTAT_SWAP_FILE_READ */
+          case VMSTAT_PAGE_FAULT_ZSWAP:
+            if (i % 4 == 2) {
+               vmstats_inc(j);
+            }
+            break;
+
+          /* VMSTAT_PAGE_FAULT_DISK = VMSTAT_ELF_FILE_READ + VMSTAT_MAPPED_FILE_READ
+           *    + VMSTAT_SWAP_FILE_READ */
           case VMSTAT_PAGE_FAULT_DISK:
             if (i % 2 == 0) {
                vmstats_inc(j);
@@ -226,7 +237,13 @@ vmstats_thread(void *junk, unsigned long num)
             break;
 
           case VMSTAT_ELF_FILE_READ:
-            if (i % 4 == 0) {
+            if (i % 8 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_MAPPED_FILE_READ:
+            if (i % 8 == 4) {
                vmstats_inc(j);
             }
             break;
@@ -243,6 +260,60 @@ vmstats_thread(void *junk, unsigned long num)
             }
             break;
 
+          case VMSTAT_TLB_FLUSH_AVOIDED:
+            vmstats_inc(j);
+            break;
+
+          case VMSTAT_PAGE_FAULT_CACHED:
+            if (i % 2 == 1) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_PREFETCH:
+            if (i % 4 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_PREFETCH_USED:
+            if (i % 8 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_SHOOTDOWN_IPI:
+            if (i % 4 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_SHOOTDOWN_SKIPPED:
+            if (i % 2 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          /* Works out to a compression ratio of 4 */
+          case VMSTAT_ZSWAP_STORE:
+            if (i % 4 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_ZSWAP_BYTES:
+            if (i % 4 == 0) {
+               vmstats_add(j, 1024);
+            }
+            break;
+
+          case VMSTAT_ZSWAP_REJECT:
+          case VMSTAT_ZSWAP_SPILL:
+            if (i % 8 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
           default:
             kprintf("Unknown stat %d\n", j);
             break;
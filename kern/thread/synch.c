@@ -39,6 +39,23 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem.h>
+
+/* Object caches for semaphores and locks; see synch_bootstrap. */
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+
+void
+synch_bootstrap(void)
+{
+	sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+				      NULL, NULL);
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       NULL, NULL);
+	if (sem_cache == NULL || lock_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -51,21 +68,21 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(sem_cache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		kmem_cache_free(sem_cache, sem);
 		return NULL;
 	}
 
@@ -84,7 +101,7 @@ sem_destroy(struct semaphore *sem)
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(sem_cache, sem);
 }
 
 void 
@@ -152,14 +169,14 @@ lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(lock_cache, lock);
                 return NULL;
         }
         
@@ -176,7 +193,7 @@ lock_destroy(struct lock *lock)
         // add stuff here as needed
         
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(lock_cache, lock);
 }
 
 void
@@ -50,6 +50,8 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <coremap.h>
+#include <kmem.h>
 
 #include "opt-synchprobs.h"
 
@@ -72,6 +74,12 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Object caches for thread and wait channel structures. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
+static void thread_promote(struct thread *cur);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +119,52 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Thread structures are cached (see thread_bootstrap) with their
+ * stacks still attached, so that thread_fork usually needn't get a
+ * new stack and write the magic number on it. A cached thread is
+ * constructed as having no stack yet.
+ */
+static
+void
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = NULL;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+}
+
+/*
+ * Make sure THREAD has a stack: reuse the one it came out of the
+ * cache with, or allocate one.
+ */
+static
+int
+thread_getstack(struct thread *thread)
+{
+	if (thread->t_stack != NULL) {
+		thread_checkstack(thread);
+		return 0;
+	}
+	thread->t_stack = kmalloc(STACK_SIZE);
+	if (thread->t_stack == NULL) {
+		return ENOMEM;
+	}
+	thread_checkstack_init(thread);
+	return 0;
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,27 +177,47 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+	}
+	else {
+		thread->t_name = kstrdup(name);
+		if (thread->t_name == NULL) {
+			kmem_cache_free(thread_cache, thread);
+			return NULL;
+		}
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
+	/*
+	 * Thread subsystem fields. A recycled thread keeps the stack
+	 * it had before (see thread_destroy).
+	 */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 
+	/* New threads start at the top priority level */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_tickets = 0;
+	thread->t_pass = 0;
+	thread->t_lastcpu = NULL;
+	thread->t_lastrun = 0;
+	thread->t_runstart = 0;
+	thread->t_lastslice = 0;
+	thread->t_tlbfaults = 0;
+	thread->t_lastfaults = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -180,15 +254,28 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_lastboost = 0;
+	c->c_migattempts = 0;
+	c->c_migrations = 0;
+	c->c_migsuppressed = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
+	c->c_runweight = 0;
+	c->c_pass = 0;
+	c->c_steals = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
 
+	c->c_framecache_count = 0;
+	c->c_framecache_hits = 0;
+	c->c_framecache_misses = 0;
+	c->c_framecache_drains = 0;
+	spinlock_init(&c->c_framecache_lock);
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
@@ -209,16 +296,16 @@ cpu_create(unsigned hardware_number)
 		 * Leave c->c_curthread->t_stack NULL for the boot
 		 * cpu. This means we're using the boot stack, which
 		 * can't be freed. (Exercise: what would it take to
-		 * make it possible to free the boot stack?)
+		 * make it possible to free the boot stack?) Nothing
+		 * has been recycled yet, so it has no stack attached.
 		 */
-		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
-		if (c->c_curthread->t_stack == NULL) {
+		result = thread_getstack(c->c_curthread);
+		if (result) {
 			panic("cpu_create: couldn't allocate stack");
 		}
-		thread_checkstack_init(c->c_curthread);
 	}
 	c->c_curthread->t_cpu = c;
 
@@ -227,6 +314,22 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus, and lookup by software cpu number.
+ */
+unsigned
+cpu_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_getcpu(unsigned index)
+{
+	KASSERT(index < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, index);
+}
+
 /*
  * Destroy a thread.
  *
@@ -247,19 +350,23 @@ thread_destroy(struct thread *thread)
 	 * either here or in thread_exit(). (And not both...)
 	 */
 
-	/* Thread subsystem fields */
+	/*
+	 * Thread subsystem fields. The stack stays with the thread
+	 * structure in the cache, magic number and all, for the next
+	 * thread_fork; thread_dtor frees it if the cache lets go.
+	 */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
+	thread_checkstack(thread);
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
-	kfree(thread);
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+	}
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -306,6 +413,7 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	curcpu->c_runweight = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -351,6 +459,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -426,6 +540,174 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Tickets a thread counts for, both in stride scheduling and when
+ * balancing load across cpus.
+ */
+static
+unsigned
+thread_weight(struct thread *t)
+{
+	return t->t_tickets > 0 ? t->t_tickets : THREAD_DEFTICKETS;
+}
+
+/*
+ * Put a thread on a cpu's run queue, which is kept sorted by priority
+ * level. Each level is served in FIFO order, except the bottom one,
+ * which goes by stride pass (see schedule()). The run queue must be
+ * locked.
+ */
+static
+void
+thread_enqueue(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+	struct thread *t2;
+	bool bottom;
+
+	bottom = t->t_priority == THREAD_NPRI - 1;
+	if (bottom && t->t_pass < c->c_pass) {
+		/* No credit for time spent asleep or higher up. */
+		t->t_pass = c->c_pass;
+	}
+	c->c_runweight += thread_weight(t);
+
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_self != NULL;
+	     tln = tln->tln_prev) {
+		t2 = tln->tln_self;
+		if (t2->t_priority < t->t_priority ||
+		    (t2->t_priority == t->t_priority &&
+		     (!bottom || t2->t_pass <= t->t_pass))) {
+			threadlist_insertafter(&c->c_runqueue, t2, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * Take a thread off a cpu's run queue, which must be locked.
+ */
+static
+void
+thread_dequeue(struct cpu *c, struct thread *t)
+{
+	threadlist_remove(&c->c_runqueue, t);
+	c->c_runweight -= thread_weight(t);
+}
+
+/*
+ * The thread at the head of a cpu's run queue, or NULL.
+ */
+static
+struct thread *
+thread_runhead(struct cpu *c)
+{
+	return c->c_runqueue.tl_head.tln_next->tln_self;
+}
+
+/*
+ * Work stealing. Called by a cpu with nothing to run, with its run
+ * queue locked, to take the first thread in the busiest other cpu's
+ * run queue onto its own: the one that cpu would run next, which is
+ * the one left waiting longest if we don't. Returns true if our run
+ * queue is no longer empty, either from stealing or because something
+ * arrived while the lock was dropped.
+ *
+ * To avoid deadlock, two run queue locks are only ever held together
+ * in cpu number order. If the victim's number is lower than ours, we
+ * drop our own lock and take both again.
+ */
+static
+bool
+thread_steal(void)
+{
+	unsigned i, numcpus, most;
+	struct cpu *c, *victim;
+	struct threadlistnode *tln;
+	struct thread *t;
+
+	/* Choose the victim by peeking without locks; it's only a hint. */
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		if (c->c_runqueue.tl_count > most) {
+			most = c->c_runqueue.tl_count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	if (victim->c_number < curcpu->c_number) {
+		spinlock_release(&curcpu->c_runqueue_lock);
+		spinlock_acquire(&victim->c_runqueue_lock);
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		if (thread_runhead(curcpu->c_self) != NULL) {
+			spinlock_release(&victim->c_runqueue_lock);
+			return true;
+		}
+	}
+	else {
+		spinlock_acquire(&victim->c_runqueue_lock);
+	}
+
+	/*
+	 * The victim's curthread can be on its run queue if it slept
+	 * and was woken while the victim was idling; that one has to
+	 * stay put. (See thread_consider_migration.)
+	 */
+	for (tln = victim->c_runqueue.tl_head.tln_next; tln->tln_self != NULL;
+	     tln = tln->tln_next) {
+		t = tln->tln_self;
+		if (t == victim->c_curthread) {
+			continue;
+		}
+		thread_dequeue(victim, t);
+		if (t->t_priority == THREAD_NPRI - 1) {
+			t->t_pass = t->t_pass - victim->c_pass + curcpu->c_pass;
+		}
+		t->t_cpu = curcpu->c_self;
+		thread_enqueue(curcpu->c_self, t);
+		curcpu->c_steals++;
+		spinlock_release(&victim->c_runqueue_lock);
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+		return true;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+	return false;
+}
+
+/*
+ * Wake up an idle cpu, if there is one, so that it can steal a thread
+ * just made runnable on a busy cpu instead of the thread waiting for
+ * the busy cpu's running thread to give up. Call with BUSY's run
+ * queue locked.
+ */
+static
+void
+thread_kickidle(struct cpu *busy)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +732,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_enqueue(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +740,15 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		/*
+		 * The target would otherwise wait for the running
+		 * thread's quantum to run out, which at the bottom
+		 * priority level is several clock ticks. An idle cpu
+		 * steals it in microseconds.
+		 */
+		thread_kickidle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -492,13 +783,12 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
+	/* Allocate a stack, unless it came with one */
+	result = thread_getstack(newthread);
+	if (result) {
 		thread_destroy(newthread);
-		return ENOMEM;
+		return result;
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -511,6 +801,12 @@ thread_fork(const char *name,
 	if (proc == NULL) {
 		proc = curthread->t_proc;
 	}
+
+	/* Stride-class processes' threads start in the stride class */
+	newthread->t_tickets = proc->p_tickets;
+	if (newthread->t_tickets > 0) {
+		newthread->t_priority = THREAD_NPRI - 1;
+	}
 	result = proc_addthread(proc, newthread);
 	if (result) {
 		/* thread_destroy will clean up the stack */
@@ -589,6 +885,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		thread_promote(cur);
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -627,20 +924,60 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before actually idling, try to steal work from a busier cpu.
+	 * Failing that, zero frames for the coremap's pool, a piece at
+	 * a time, letting interrupts in and checking the runqueue
+	 * between pieces so that real work isn't held up.
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
-		if (next == NULL) {
+		next = thread_runhead(curcpu->c_self);
+		if (next == NULL && thread_steal()) {
+			next = thread_runhead(curcpu->c_self);
+		}
+		if (next != NULL) {
+			thread_dequeue(curcpu->c_self, next);
+		}
+		else {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (coremap_zeroidle()) {
+				cpu_irqon();
+				cpu_irqoff();
+			}
+			else {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* Stride virtual time moves on to the pass of what we picked. */
+	if (next->t_priority == THREAD_NPRI - 1 &&
+	    next->t_pass > curcpu->c_pass) {
+		curcpu->c_pass = next->t_pass;
+	}
+
+	/*
+	 * Note how long cur ran, and how hard it hit the TLB, here.
+	 * If cur was picked again it keeps running, and its run goes
+	 * on across the quanta until something else is picked. The
+	 * refills the UTLB handler did on this cpu since the last
+	 * switch were all cur's.
+	 */
+	cur->t_tlbfaults += vm_tlbrefills();
+	if (next != cur) {
+		cur->t_lastcpu = curcpu->c_self;
+		cur->t_lastrun = curcpu->c_hardclocks;
+		cur->t_lastslice = curcpu->c_hardclocks - cur->t_runstart;
+		cur->t_lastfaults = cur->t_tlbfaults;
+		cur->t_tlbfaults = 0;
+		next->t_runstart = curcpu->c_hardclocks;
+	}
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -822,17 +1159,157 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each thread has a priority
+ * level, 0 (highest) to THREAD_NPRI-1, and each cpu's run queue is
+ * kept sorted by level (see thread_enqueue), so thread_switch always
+ * picks the first thread at the highest level that has any.
+ *
+ * A thread runs for the quantum of its level, which doubles at each
+ * level down. If it uses the whole quantum it drops a level; threads
+ * that compute a lot thus sink and get longer, rarer turns. If it
+ * sleeps having used less than the quantum of the level above, it
+ * rises a level, so threads that mostly wait (on the console, say)
+ * float to the top and run as soon as they wake. A thread that is
+ * running is preempted on the next tick if something at a higher
+ * level becomes runnable.
+ *
+ * To keep threads at the bottom from starving, and to let threads
+ * that have stopped computing get back up, schedule() periodically
+ * moves every thread on the cpu back to level 0.
+ *
+ * The bottom level is shared by stride scheduling. Each thread there
+ * has a pass, advanced by its stride (THREAD_STRIDE1 / tickets) for
+ * each tick it runs, and the level is ordered by pass, so over time
+ * threads get cpu in proportion to their tickets. Threads in the
+ * default class count as THREAD_DEFTICKETS tickets. A process can put
+ * itself in the stride class with the settickets system call; its
+ * threads then stay at the bottom level for good, neither promoted
+ * nor boosted, and so get a fixed share of whatever the interactive
+ * threads above them leave over. Each cpu keeps the pass of the last
+ * bottom-level thread it picked (c_pass) as virtual time; threads
+ * joining the level start from there, so sleeping earns no credit.
  */
 
+/* Quantum of each level, in hardclocks */
+static const unsigned thread_quanta[THREAD_NPRI] = { 1, 2, 4, 8 };
+
+/* How often to boost everything to level 0, in hardclocks */
+#define THREAD_BOOST_HARDCLOCKS  100
+
+/* Stride of a thread with one ticket */
+#define THREAD_STRIDE1  (1U << 20)
+
+/*
+ * Called when CUR is about to sleep: move it up a level if it used
+ * less than the higher level's quantum, and start a new quantum.
+ */
+static
+void
+thread_promote(struct thread *cur)
+{
+	if (cur->t_tickets == 0 && cur->t_priority > 0 &&
+	    cur->t_ticks < thread_quanta[cur->t_priority - 1]) {
+		cur->t_priority--;
+	}
+	cur->t_ticks = 0;
+}
+
+void
+thread_tick(void)
+{
+	struct thread *cur, *next;
+	bool preempt;
+
+	/* Nothing to charge if the timer interrupted the idle loop. */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	cur->t_ticks++;
+	if (cur->t_priority == THREAD_NPRI - 1) {
+		cur->t_pass += THREAD_STRIDE1 / thread_weight(cur);
+	}
+	if (cur->t_ticks >= thread_quanta[cur->t_priority]) {
+		if (cur->t_priority < THREAD_NPRI - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		thread_yield();
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	next = thread_runhead(curcpu->c_self);
+	preempt = next != NULL && next->t_priority < cur->t_priority;
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). It does the priority
+ * boost.
+ */
 void
 schedule(void)
 {
+	struct threadlistnode *tln;
+	struct thread *t;
+	struct threadlist boosted;
+
+	if (curcpu->c_hardclocks - curcpu->c_lastboost <
+	    THREAD_BOOST_HARDCLOCKS) {
+		return;
+	}
+	curcpu->c_lastboost = curcpu->c_hardclocks;
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Take the default-class threads off the run queue and put
+	 * them back at level 0. They go back in the order they were
+	 * in, so those that were higher up stay in front. Stride-class
+	 * threads stay where they are.
 	 */
+	threadlist_init(&boosted);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	tln = curcpu->c_runqueue.tl_head.tln_next;
+	while (tln->tln_self != NULL) {
+		t = tln->tln_self;
+		tln = tln->tln_next;
+		if (t->t_tickets == 0) {
+			thread_dequeue(curcpu->c_self, t);
+			threadlist_addtail(&boosted, t);
+		}
+	}
+	while ((t = threadlist_remhead(&boosted)) != NULL) {
+		t->t_priority = 0;
+		t->t_ticks = 0;
+		thread_enqueue(curcpu->c_self, t);
+	}
+	if (!curcpu->c_isidle && curthread->t_tickets == 0) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&boosted);
+}
+
+void
+thread_settickets(unsigned tickets)
+{
+	struct thread *cur;
+	int spl;
+
+	KASSERT(tickets <= THREAD_MAXTICKETS);
+
+	cur = curthread;
+	spl = splhigh();
+	cur->t_tickets = tickets;
+	cur->t_priority = tickets > 0 ? THREAD_NPRI - 1 : 0;
+	cur->t_ticks = 0;
+	splx(spl);
 }
 
 /*
@@ -848,87 +1325,159 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * So each candidate is run past a cost model, and threads whose cache
+ * state here is likely still warm are left alone. A thread's footprint
+ * is estimated from how long it ran last time (mig_runcost per
+ * hardclock) and how many TLB refills it took doing so (mig_tlbcost
+ * each), the refills standing in for its working set. Only refills of
+ * pages already in memory count, whether done by the UTLB handler or
+ * by vm_fault; first touches and page-ins say little about what is
+ * still cached. The footprint is taken to decay linearly to nothing
+ * over mig_decay hardclocks after the thread stops running, as other
+ * threads displace it. A thread is migrated only if what is left, the
+ * cost, is at most mig_maxcost. Threads that last ran on some other
+ * cpu cost nothing to move.
+ *
+ * System/161 does not (yet) model cache effects, so the defaults only
+ * hold back threads that have just run for a good while or over a
+ * lot of pages; the tunables can be changed from the kernel menu.
+ * Setting mig_decay to 0 makes every migration free.
+ */
+
+static unsigned mig_decay = 8;
+static unsigned mig_runcost = 4;
+static unsigned mig_tlbcost = 1;
+static unsigned mig_maxcost = 16;
+
+static const struct {
+	const char *name;
+	unsigned *var;
+	const char *desc;
+} thread_migtunables[] = {
+	{ "decay",	&mig_decay,	"hardclocks for a footprint to go cold" },
+	{ "runcost",	&mig_runcost,	"cost per hardclock of the last run" },
+	{ "tlbcost",	&mig_tlbcost,	"cost per TLB refill in the last run" },
+	{ "maxcost",	&mig_maxcost,	"most cost a migration may have" },
+	{ NULL, NULL, NULL }
+};
+
+/*
+ * Cost of moving T off the current cpu.
  */
+static
+unsigned
+thread_migcost(struct thread *t)
+{
+	unsigned age, footprint;
+
+	if (t->t_lastcpu != curcpu->c_self) {
+		return 0;
+	}
+	age = curcpu->c_hardclocks - t->t_lastrun;
+	if (age >= mig_decay) {
+		return 0;
+	}
+	footprint = mig_runcost * t->t_lastslice +
+		mig_tlbcost * t->t_lastfaults;
+	return footprint * (mig_decay - age) / mig_decay;
+}
+
 void
 thread_consider_migration(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
+	unsigned my_load, total_load, one_share;
 	unsigned i, numcpus;
 	struct cpu *c;
+	struct threadlistnode *tln;
 	struct threadlist victims;
 	struct thread *t;
 
-	my_count = total_count = 0;
+	/*
+	 * Load is counted in tickets (see thread_weight), so that cpus
+	 * end up with equal amounts of stride weight rather than equal
+	 * numbers of threads.
+	 */
+	my_load = total_load = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_load += c->c_runweight;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_load = c->c_runweight;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	one_share = DIVROUNDUP(total_load, numcpus);
+	if (my_load <= one_share) {
 		return;
 	}
 
-	to_send = my_count - one_share;
+	/*
+	 * Pick victims from the tail of the run queue (the lowest
+	 * priority, or the furthest ahead in pass), skipping any whose
+	 * weight would take us below our share. Their pass is kept
+	 * relative to our virtual time while they are in transit.
+	 */
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+	tln = curcpu->c_runqueue.tl_tail.tln_prev;
+	while (tln->tln_self != NULL && curcpu->c_runweight > one_share) {
+		t = tln->tln_self;
+		tln = tln->tln_prev;
+		/*
+		 * Ordinarily, curthread will not appear on the run
+		 * queue. However, it can under the following
+		 * circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it remained
+		 *     curthread;
+		 *   - it was reawakened, so it was put on the run
+		 *     queue;
+		 *   - and the processor hasn't fully unidled yet, so
+		 *     all these things are still true.
+		 *
+		 * If the timer interrupt happens at (almost) exactly
+		 * the proper moment, we can come here while things are
+		 * in this state and see curthread. However,
+		 * *migrating* curthread can cause bad things to happen
+		 * (Exercise: Why? And what?) so leave it be.
+		 */
+		if (t == curthread ||
+		    curcpu->c_runweight - thread_weight(t) < one_share) {
+			continue;
+		}
+		curcpu->c_migattempts++;
+		if (thread_migcost(t) > mig_maxcost) {
+			curcpu->c_migsuppressed++;
+			continue;
+		}
+		thread_dequeue(curcpu->c_self, t);
+		if (t->t_priority == THREAD_NPRI - 1) {
+			t->t_pass -= curcpu->c_pass;
+		}
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	for (i=0; i < numcpus && !threadlist_isempty(&victims); i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
+		while (c->c_runweight < one_share &&
+		       (t = threadlist_remhead(&victims)) != NULL) {
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			if (t->t_priority == THREAD_NPRI - 1) {
+				t->t_pass += c->c_pass;
+			}
+			thread_enqueue(c, t);
+			curcpu->c_migrations++;
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
 			if (c->c_isidle) {
 				/*
 				 * Other processor is idle; send
@@ -941,14 +1490,17 @@ thread_consider_migration(void)
 	}
 
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
+	 * Because the code above isn't atomic, the loads may have
 	 * changed while we were working and we may end up with leftovers.
 	 * Don't panic; just put them back on our own run queue.
 	 */
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			if (t->t_priority == THREAD_NPRI - 1) {
+				t->t_pass += curcpu->c_pass;
+			}
+			thread_enqueue(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -957,12 +1509,108 @@ thread_consider_migration(void)
 	threadlist_cleanup(&victims);
 }
 
+void
+thread_printsched(void)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+	struct threadlistnode *tln;
+	struct thread *t;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		kprintf("cpu%u: ", c->c_number);
+		if (c->c_isidle) {
+			kprintf("idle");
+		}
+		else {
+			t = c->c_curthread;
+			kprintf("running %s (pri %u, %u/%u ticks, %u tickets)",
+				t->t_name, t->t_priority, t->t_ticks,
+				thread_quanta[t->t_priority], t->t_tickets);
+		}
+		kprintf(", %u ready, load %u, %u stolen\n",
+			c->c_runqueue.tl_count, c->c_runweight, c->c_steals);
+		for (tln = c->c_runqueue.tl_head.tln_next;
+		     tln->tln_self != NULL; tln = tln->tln_next) {
+			t = tln->tln_self;
+			kprintf("    %s (pri %u, %u tickets)\n", t->t_name,
+				t->t_priority, t->t_tickets);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+}
+
+int
+thread_setmigtunable(const char *name, unsigned value)
+{
+	unsigned i;
+
+	for (i=0; thread_migtunables[i].name != NULL; i++) {
+		if (!strcmp(thread_migtunables[i].name, name)) {
+			*thread_migtunables[i].var = value;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+void
+thread_printmigration(void)
+{
+	unsigned i, numcpus, attempts, migrations, suppressed;
+	struct cpu *c;
+
+	for (i=0; thread_migtunables[i].name != NULL; i++) {
+		kprintf("%-8s %6u  %s\n", thread_migtunables[i].name,
+			*thread_migtunables[i].var,
+			thread_migtunables[i].desc);
+	}
+
+	attempts = migrations = suppressed = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		attempts += c->c_migattempts;
+		migrations += c->c_migrations;
+		suppressed += c->c_migsuppressed;
+	}
+	kprintf("Migrations: %u attempted, %u performed, %u suppressed\n",
+		attempts, migrations, suppressed);
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
  * Wait channel functions
  */
 
+/*
+ * Wait channels are cached in their constructed state: lock free and
+ * no threads waiting, which is also what wchan_destroy requires.
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+}
+
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					wchan_ctor, NULL);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,12 +1624,10 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
@@ -993,9 +1639,10 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
+	/* These only check; the wchan stays constructed for reuse. */
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(wchan_cache, wc);
 }
 
 /*
@@ -1143,25 +1790,65 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	int n;
+	ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+void
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i, k;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
+	if (target->c_numshootdown == TLBSHOOTDOWN_ALL) {
+		/* Already flushing everything. */
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		k = target->c_numshootdown;
+		if (k + n > TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+		}
+		else {
+			for (i=0; i<n; i++) {
+				target->c_shootdown[k+i] = mappings[i];
+			}
+			target->c_numshootdown = k + n;
+		}
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	/*
+	 * If a shootdown is already pending, its interrupt is on the
+	 * way and the handler will pick up what we just queued, since
+	 * it looks at the queue under the same lock.
+	 */
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(target);
+	}
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_wait(struct cpu *target)
+{
+	bool pending;
+
+	/*
+	 * Spin with interrupts on, so that if TARGET is waiting for us
+	 * in the same way we still answer it.
+	 */
+	KASSERT(curthread->t_curspl == 0);
+
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		pending = (target->c_ipi_pending &
+			   ((uint32_t)1 << IPI_TLBSHOOTDOWN)) != 0;
+		spinlock_release(&target->c_ipi_lock);
+	} while (pending);
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -0,0 +1,695 @@
+/*
+ * Address spaces for the paged VM system: a list of regions plus a
+ * page table. See addrspace.h for the interface; faults are handled
+ * in vm.c.
+ */
+
+#define ADDRSPACEINLINE
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <zswap.h>
+
+/*
+ * The stack region reserves vm_stacklimit pages below USERSTACK, which
+ * fault in as they are touched, with an unmapped guard page below
+ * that. The limit can be changed (for new stacks) up to
+ * VM_STACKMAXPAGES.
+ */
+#define VM_STACKPAGES    256
+#define VM_STACKMAXPAGES 4095
+
+static unsigned vm_stacklimit = VM_STACKPAGES;
+
+/* mmap regions go below here, top down, clear of the biggest stack. */
+#define VM_MMAPTOP       (USERSTACK - (VM_STACKMAXPAGES + 1) * PAGE_SIZE)
+
+/*
+ * Free NPAGES pages of region RG from VADDR on, in core and in swap,
+ * writing modified MAP_SHARED pages back first. Call with the pages
+ * locked (they are unlocked during writeback), and get rid of stale
+ * TLB entries afterwards. Returns the
+ * first writeback error, if any; the pages are freed regardless.
+ */
+static
+int
+as_freepages(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	     size_t npages)
+{
+	vaddr_t va;
+	uint32_t *pte;
+	size_t i;
+	int result, err;
+
+	result = 0;
+	for (i=0; i<npages; i++) {
+		va = vaddr + i * PAGE_SIZE;
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL) {
+			continue;
+		}
+		while (*pte & PTE_BUSY) {
+			vm_pagewait();
+		}
+		if (*pte & PTE_INCORE) {
+			if ((rg->rg_flags & RG_SHARED) &&
+			    rg->rg_vnode != NULL && (*pte & PTE_DIRTY)) {
+				*pte |= PTE_BUSY;
+				vm_unlockpages();
+				err = vm_writeback(rg, va, *pte & PTE_FRAME);
+				vm_lockpages();
+				vm_pageunbusy(pte);
+				if (err && result == 0) {
+					result = err;
+				}
+			}
+			coremap_unshare(*pte & PTE_FRAME, as, va);
+		}
+		else if (*pte & PTE_ZSWAPPED) {
+			zswap_free(PTE_SLOT(*pte));
+		}
+		else if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(*pte));
+		}
+		*pte = 0;
+	}
+	return result;
+}
+
+/*
+ * Free the pages of region RG and drop its file. Call with the pages
+ * locked. Returns as for as_freepages.
+ */
+static
+int
+as_freeregion(struct addrspace *as, struct region *rg)
+{
+	int result;
+
+	result = as_freepages(as, rg, rg->rg_vbase, rg->rg_npages);
+	if (rg->rg_vnode != NULL) {
+		VOP_DECREF(rg->rg_vnode);
+		rg->rg_vnode = NULL;
+	}
+	return result;
+}
+
+/*
+ * Add a region [VADDR, VADDR+NPAGES*PAGE_SIZE) with permissions PERMS.
+ * VADDR must be page-aligned.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vaddr, size_t npages, int perms,
+	     struct region **ret)
+{
+	struct region *rg;
+	vaddr_t top;
+	unsigned i, num;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	if (npages > USERSPACETOP / PAGE_SIZE ||
+	    vaddr > USERSPACETOP - npages * PAGE_SIZE) {
+		return EFAULT;
+	}
+	top = vaddr + npages * PAGE_SIZE;
+
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+		    rg->rg_vbase < top) {
+			kprintf("vm: Warning: overlapping regions\n");
+			return EINVAL;
+		}
+	}
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_perms = perms;
+	rg->rg_flags = 0;
+	rg->rg_vnode = NULL;
+	bzero(&rg->rg_back, sizeof(rg->rg_back));
+	rg->rg_advice = MADV_NORMAL;
+	rg->rg_fanext = 0;
+	rg->rg_fawindow = 0;
+
+	result = regionarray_add(&as->as_regions, rg, NULL);
+	if (result) {
+		kfree(rg);
+		return result;
+	}
+	if (ret != NULL) {
+		*ret = rg;
+	}
+	return 0;
+}
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	regionarray_init(&as->as_regions);
+	as->as_vnode = NULL;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_cpus = 0;
+
+	return as;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct region *oldrg, *newrg;
+	uint32_t *oldpte, *newpte;
+	paddr_t pa;
+	vaddr_t va;
+	unsigned i, num;
+	size_t j;
+	int result;
+
+	new = as_create();
+	if (new == NULL) {
+		return ENOMEM;
+	}
+
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+
+	vm_lockpages();
+
+	num = regionarray_num(&old->as_regions);
+	for (i=0; i<num; i++) {
+		oldrg = regionarray_get(&old->as_regions, i);
+		result = as_addregion(new, oldrg->rg_vbase, oldrg->rg_npages,
+				      oldrg->rg_perms, &newrg);
+		if (result) {
+			goto fail;
+		}
+		newrg->rg_flags = oldrg->rg_flags;
+		newrg->rg_advice = oldrg->rg_advice;
+		if (oldrg->rg_vnode != NULL) {
+			VOP_INCREF(oldrg->rg_vnode);
+			newrg->rg_vnode = oldrg->rg_vnode;
+		}
+		newrg->rg_back = oldrg->rg_back;
+
+		for (j=0; j<oldrg->rg_npages; j++) {
+			va = oldrg->rg_vbase + j * PAGE_SIZE;
+			oldpte = pt_lookup(old->as_pt, va, false);
+			if (oldpte == NULL) {
+				continue;
+			}
+			while (*oldpte & PTE_BUSY) {
+				vm_pagewait();
+			}
+			if (*oldpte == 0) {
+				/* Untouched; it will fault in. */
+				continue;
+			}
+			newpte = pt_lookup(new->as_pt, va, true);
+			if (newpte == NULL) {
+				result = ENOMEM;
+				goto fail;
+			}
+
+			if (*oldpte & PTE_INCORE) {
+				/* Share it copy-on-write (see vm.c). */
+				coremap_share(*oldpte & PTE_FRAME, new, va);
+				*oldpte &= ~PTE_WRITE;
+				*newpte = *oldpte;
+				continue;
+			}
+
+			if (*oldpte & PTE_SWAPPED) {
+				/*
+				 * Share the slot; each side reads its own
+				 * copy in when it next touches the page.
+				 */
+				swap_share(PTE_SLOT(*oldpte));
+				*newpte = *oldpte;
+				continue;
+			}
+
+			/*
+			 * Compressed. Entries in the pool aren't shared,
+			 * so decompress it into a frame of the child's
+			 * own. Look at the PTE only after allocating,
+			 * which may move the page from the pool to disk.
+			 */
+			pa = vm_allocframe(new, va, false);
+			if (pa == 0) {
+				result = ENOMEM;
+				goto fail;
+			}
+			while (*oldpte & PTE_BUSY) {
+				vm_pagewait();
+			}
+			if (*oldpte & PTE_SWAPPED) {
+				coremap_free(pa);
+				swap_share(PTE_SLOT(*oldpte));
+				*newpte = *oldpte;
+				continue;
+			}
+			KASSERT(*oldpte & PTE_ZSWAPPED);
+			zswap_load(PTE_SLOT(*oldpte), pa);
+			*newpte = pa | PTE_INCORE | PTE_VALID | PTE_DIRTY;
+			if (newrg->rg_perms & RG_WRITE) {
+				*newpte |= PTE_WRITE;
+			}
+		}
+	}
+
+	vm_unlockpages();
+
+	/* The parent may still have writeable TLB entries. */
+	vm_tlbinvalidate(old);
+
+	*ret = new;
+	return 0;
+
+ fail:
+	vm_unlockpages();
+	vm_tlbinvalidate(old);
+	as_destroy(new);
+	return result;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct region *rg;
+	unsigned i, num;
+
+	vm_lockpages();
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		/* Nobody to report writeback errors to. */
+		(void)as_freeregion(as, rg);
+		kfree(rg);
+	}
+	regionarray_setsize(&as->as_regions, 0);
+	vm_unlockpages();
+	regionarray_cleanup(&as->as_regions);
+
+	/* Keep the UTLB refill handler away from the page table. */
+	vm_tlbdeactivate(as);
+	pt_destroy(as->as_pt);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
+	kfree(as);
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * Kernel threads don't have an address space to
+		 * activate. Leave the TLB and current ASID alone, so
+		 * that switching back to the same process is free.
+		 */
+		return;
+	}
+
+	vm_tlbactivate(as);
+}
+
+void
+as_deactivate(void)
+{
+	/* nothing */
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	int perms;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	perms = 0;
+	if (readable) {
+		perms |= RG_READ;
+	}
+	if (writeable) {
+		perms |= RG_WRITE;
+	}
+	if (executable) {
+		perms |= RG_EXEC;
+	}
+
+	return as_addregion(as, vaddr, sz / PAGE_SIZE, perms, NULL);
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing to do; pages are allocated as they fault. */
+	(void)as;
+	return 0;
+}
+
+int
+as_define_backing(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t memsize, size_t filesize)
+{
+	struct region *rg;
+	vaddr_t top;
+
+	KASSERT(filesize <= memsize);
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	if (memsize > top - vaddr) {
+		return EFAULT;
+	}
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	rg->rg_back.sb_vaddr = vaddr;
+	rg->rg_back.sb_offset = offset;
+	rg->rg_back.sb_filesz = filesize;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	/* Text that other processes have already read in costs nothing. */
+	vm_premap(as);
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	vaddr_t base;
+	int result;
+
+	base = USERSTACK - vm_stacklimit * PAGE_SIZE;
+	result = as_addregion(as, base, vm_stacklimit, RG_READ | RG_WRITE,
+			      NULL);
+	if (result) {
+		return result;
+	}
+
+	/* Overflowing the stack should fault, not run into something. */
+	result = as_addregion(as, base - PAGE_SIZE, 1, 0, NULL);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+unsigned
+as_getstacklimit(void)
+{
+	return vm_stacklimit;
+}
+
+int
+as_setstacklimit(unsigned npages)
+{
+	if (npages == 0 || npages > VM_STACKMAXPAGES) {
+		return EINVAL;
+	}
+	vm_stacklimit = npages;
+	return 0;
+}
+
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned i, num;
+
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find NPAGES of unused address space for an mmap region, as high as
+ * possible below VM_MMAPTOP, and leave the base in *RET.
+ */
+static
+int
+as_findgap(struct addrspace *as, size_t npages, vaddr_t *ret)
+{
+	struct region *rg;
+	vaddr_t base, top;
+	unsigned i, num;
+	bool moved;
+
+	top = VM_MMAPTOP;
+	do {
+		/* Keep page 0 unmapped. */
+		if (npages >= top / PAGE_SIZE) {
+			return ENOMEM;
+		}
+		base = top - npages * PAGE_SIZE;
+
+		moved = false;
+		num = regionarray_num(&as->as_regions);
+		for (i=0; i<num; i++) {
+			rg = regionarray_get(&as->as_regions, i);
+			if (base < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+			    rg->rg_vbase < top) {
+				top = rg->rg_vbase;
+				moved = true;
+			}
+		}
+	} while (moved);
+
+	*ret = base;
+	return 0;
+}
+
+int
+as_map(struct addrspace *as, size_t len, int perms, int flags,
+       struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	struct region *rg;
+	size_t npages;
+	vaddr_t vaddr;
+	int result;
+
+	KASSERT(len > 0);
+	KASSERT(offset >= 0 && offset % PAGE_SIZE == 0);
+
+	npages = len / PAGE_SIZE + (len % PAGE_SIZE != 0);
+	result = as_findgap(as, npages, &vaddr);
+	if (result) {
+		return result;
+	}
+	result = as_addregion(as, vaddr, npages, perms, &rg);
+	if (result) {
+		return result;
+	}
+	rg->rg_flags = flags | RG_MAPPED;
+	if (v != NULL) {
+		VOP_INCREF(v);
+		rg->rg_vnode = v;
+		/*
+		 * Every page comes from the file, whatever its size now:
+		 * it may grow, and the page cache knows a page by file
+		 * and offset, so every mapping of it has to agree on
+		 * what is in it. Anything past the end reads as zero.
+		 */
+		rg->rg_back.sb_vaddr = vaddr;
+		rg->rg_back.sb_offset = offset;
+		rg->rg_back.sb_filesz = npages * PAGE_SIZE;
+	}
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg;
+	vaddr_t top, rgtop;
+	unsigned i, num;
+	int result, err;
+
+	if ((vaddr & PAGE_FRAME) != vaddr || len == 0 ||
+	    vaddr >= USERSPACETOP || len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	top = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+
+	/* Check it all first, so as not to stop halfway. */
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		rgtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (vaddr < rgtop && rg->rg_vbase < top &&
+		    (!(rg->rg_flags & RG_MAPPED) ||
+		     rg->rg_vbase < vaddr || rgtop > top)) {
+			return EINVAL;
+		}
+	}
+
+	result = 0;
+	vm_lockpages();
+	i = 0;
+	while (i < regionarray_num(&as->as_regions)) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_vbase >= vaddr && rg->rg_vbase < top) {
+			err = as_freeregion(as, rg);
+			if (err && result == 0) {
+				result = err;
+			}
+			regionarray_remove(&as->as_regions, i);
+			kfree(rg);
+		}
+		else {
+			i++;
+		}
+	}
+	vm_unlockpages();
+
+	vm_tlbinvalidate(as);
+	return result;
+}
+
+int
+as_advise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+	struct region *rg;
+	vaddr_t top, rgtop, start, end;
+	size_t covered;
+	unsigned i, num;
+	int result, err;
+
+	if ((vaddr & PAGE_FRAME) != vaddr || len == 0 ||
+	    vaddr >= USERSPACETOP || len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	switch (advice) {
+	    case MADV_NORMAL:
+	    case MADV_RANDOM:
+	    case MADV_SEQUENTIAL:
+	    case MADV_WILLNEED:
+	    case MADV_DONTNEED:
+		break;
+	    default:
+		return EINVAL;
+	}
+	top = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+
+	/* All of it has to be mapped. */
+	covered = 0;
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		rgtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (vaddr < rgtop && rg->rg_vbase < top) {
+			start = rg->rg_vbase > vaddr ? rg->rg_vbase : vaddr;
+			end = rgtop < top ? rgtop : top;
+			covered += end - start;
+		}
+	}
+	if (covered != top - vaddr) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	if (advice == MADV_DONTNEED) {
+		vm_lockpages();
+	}
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		rgtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (vaddr >= rgtop || rg->rg_vbase >= top) {
+			continue;
+		}
+		start = rg->rg_vbase > vaddr ? rg->rg_vbase : vaddr;
+		end = rgtop < top ? rgtop : top;
+
+		switch (advice) {
+		    case MADV_WILLNEED:
+			if (rg->rg_perms != 0) {
+				vm_prefetch(as, rg, start,
+					    (end - start) / PAGE_SIZE);
+			}
+			break;
+		    case MADV_DONTNEED:
+			err = as_freepages(as, rg, start,
+					   (end - start) / PAGE_SIZE);
+			if (err && result == 0) {
+				result = err;
+			}
+			break;
+		    default:
+			rg->rg_advice = advice;
+			break;
+		}
+		rg->rg_fanext = 0;
+		rg->rg_fawindow = 0;
+	}
+	if (advice == MADV_DONTNEED) {
+		vm_unlockpages();
+		vm_tlbinvalidate(as);
+	}
+	return result;
+}
@@ -0,0 +1,1005 @@
+/*
+ * Physical page frame allocator. See coremap.h for the interface.
+ *
+ * The coremap itself is an array with one entry per managed frame,
+ * carved off the bottom of physical memory at bootstrap. Frames are
+ * named by their index in this array; frame i lives at physical
+ * address cm_base + i*PAGE_SIZE.
+ *
+ * Free frames are grouped into naturally aligned blocks of 2^k frames
+ * and each block is kept on the free list for order k. The lists are
+ * doubly linked through the coremap entries themselves, so a block can
+ * be pulled off its list in O(1) when its buddy is freed and the two
+ * coalesce. Allocating n frames takes a block of the smallest order
+ * that fits, splitting larger blocks as needed, and gives the unused
+ * tail back; freeing walks back up the orders merging with free
+ * buddies. Both are bounded by CM_NORDERS steps plus the O(n) cost of
+ * marking the frames themselves.
+ *
+ * In front of the free lists, each cpu keeps a small cache of free
+ * single frames (c_framecache in struct cpu). Single-page allocations
+ * and frees go to the local cache and only take coremap_lock to move
+ * CM_BATCH frames at a time in or out of it. If a request cannot be
+ * satisfied from the free lists, all cpus' caches are drained back and
+ * the request is retried, so cached frames are never lost to
+ * multi-page allocations.
+ *
+ * User frames that only one address space maps can be paged out, even
+ * if the page cache also holds them. Each user frame's coremap entry
+ * keeps the XOR of the address spaces that map it, and of the virtual
+ * addresses they map it at: coremap_share adds a mapping in and
+ * coremap_unshare takes it out again. Whenever there is one mapping
+ * left, then, the entry names it, with no list of sharers to keep;
+ * coremap_clock runs a clock hand over those frames for vm.c to pick
+ * victims from. User allocations leave CM_RESERVE frames on the
+ * free lists, so that the kernel can still allocate memory (which
+ * never pages anything out) when user memory is full.
+ *
+ * Zero-fill faults take frames from a pool of frames zeroed ahead of
+ * time by idle cpus (coremap_zeroidle, called from the idle loop in
+ * thread_switch), so that the bzero is off the fault path. The idle
+ * loop runs with interrupts off, so each call zeroes only one
+ * CM_ZEROCHUNK of a frame; the frame in progress is cm_zerocur, and
+ * how far it has got is kept in its coremap entry. The pool is small
+ * and only refilled while plenty of memory is free; if an allocation
+ * can't be satisfied otherwise it is emptied back onto the free lists
+ * like the cpu caches, along with the frame in progress.
+ *
+ * Lock ordering: a cpu's c_framecache_lock comes before coremap_lock.
+ * No code holds two frame cache locks at once.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+
+/* Frame states. */
+#define CME_FREE      0		/* free, inside a free block */
+#define CME_FREEHEAD  1		/* free, first frame of a free block */
+#define CME_KERNEL    2		/* allocated to the kernel */
+#define CME_USER      3		/* allocated to user memory */
+#define CME_CACHED    4		/* free, in some cpu's frame cache */
+#define CME_ZEROED    5		/* free, in (or going into) the zeroed pool */
+
+/* List terminator / no such frame. */
+#define CM_NONE       0xffffffff
+
+/* Frames moved between a cpu's frame cache and the free lists at once. */
+#define CM_BATCH      (CPU_FRAMECACHE_SIZE / 2)
+
+/* Free frames user allocations leave for the kernel. */
+#define CM_RESERVE    8
+
+/*
+ * Most frames kept zeroed: this many, or 1/32 of memory if less. Idle
+ * cpus only zero frames while more than CM_ZEROSLACK are free.
+ */
+#define CM_ZEROMAX    32
+#define CM_ZEROSLACK  (4 * CM_RESERVE)
+
+/* Bytes of a frame zeroed per coremap_zeroidle call. */
+#define CM_ZEROCHUNK  512
+
+struct cm_entry {
+	uint32_t cme_next;	/* free list link (frame index) */
+	uint32_t cme_prev;	/* free list link (frame index) */
+	uint32_t cme_npages;	/* run length, on first frame of a run */
+	struct addrspace *cme_as;	/* XOR of mappers (user frames) */
+	vaddr_t cme_vaddr;	/* XOR of where they map it */
+	uint16_t cme_refcount;	/* sharers, on first frame of a run */
+	uint16_t cme_zerooff;	/* bytes zeroed, while cm_zerocur */
+	uint8_t cme_order;	/* block order, on first frame of free block */
+	uint8_t cme_state;	/* CME_* */
+	uint8_t cme_pcache;	/* one of the sharers is the page cache */
+};
+
+/* Address spaces mapping user frame E (the rest are the page cache). */
+#define CM_MAPPERS(e) ((e)->cme_refcount - (e)->cme_pcache)
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct cm_entry *coremap;
+static unsigned cm_nframes;		/* number of managed frames */
+static paddr_t cm_base;			/* physical address of frame 0 */
+static bool cm_ready = false;		/* set once bootstrap is done */
+
+static uint32_t cm_freelist[CM_NORDERS];	/* heads of free lists */
+static unsigned cm_nblocks[CM_NORDERS];		/* blocks on each list */
+
+static unsigned cm_nfree;		/* frames on the free lists */
+static uint32_t cm_hand;		/* pageout clock hand */
+
+static paddr_t cm_zeroed[CM_ZEROMAX];	/* pool of zeroed frames */
+static unsigned cm_nzeroed;		/* frames in cm_zeroed */
+static uint32_t cm_zerocur = CM_NONE;	/* frame being zeroed for it */
+static bool cm_zerobusy;		/* some cpu is zeroing cm_zerocur */
+static unsigned cm_zeromax;		/* pool size for this much RAM */
+static unsigned cm_zerohits, cm_zeromisses;
+
+////////////////////////////////////////////////////////////
+//
+// Free lists
+
+/*
+ * Put block INDEX of order ORDER on its free list.
+ */
+static
+void
+cm_link(uint32_t index, unsigned order)
+{
+	struct cm_entry *e = &coremap[index];
+	uint32_t head;
+
+	KASSERT(order <= CM_MAXORDER);
+	KASSERT(index % (1U << order) == 0);
+
+	head = cm_freelist[order];
+	e->cme_state = CME_FREEHEAD;
+	e->cme_order = order;
+	e->cme_prev = CM_NONE;
+	e->cme_next = head;
+	if (head != CM_NONE) {
+		coremap[head].cme_prev = index;
+	}
+	cm_freelist[order] = index;
+	cm_nblocks[order]++;
+}
+
+/*
+ * Take block INDEX of order ORDER off its free list. The caller is
+ * responsible for setting the state of its first frame.
+ */
+static
+void
+cm_unlink(uint32_t index, unsigned order)
+{
+	struct cm_entry *e = &coremap[index];
+
+	KASSERT(e->cme_state == CME_FREEHEAD);
+	KASSERT(e->cme_order == order);
+
+	if (e->cme_prev != CM_NONE) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		KASSERT(cm_freelist[order] == index);
+		cm_freelist[order] = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_next = e->cme_prev = CM_NONE;
+	e->cme_state = CME_FREE;
+	KASSERT(cm_nblocks[order] > 0);
+	cm_nblocks[order]--;
+}
+
+/*
+ * Free block INDEX of order ORDER, merging it with its buddy for as
+ * long as the buddy is itself a whole free block.
+ */
+static
+void
+cm_buddyfree(uint32_t index, unsigned order)
+{
+	uint32_t buddy;
+
+	while (order < CM_MAXORDER) {
+		buddy = index ^ (1U << order);
+		if (buddy + (1U << order) > cm_nframes) {
+			break;
+		}
+		if (coremap[buddy].cme_state != CME_FREEHEAD ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		cm_unlink(buddy, order);
+		index &= ~(uint32_t)(1U << order);
+		order++;
+	}
+	cm_link(index, order);
+}
+
+/*
+ * Return the frames [START, END) to the free lists as a sequence of
+ * maximal aligned blocks.
+ */
+static
+void
+cm_freerange(uint32_t start, uint32_t end)
+{
+	unsigned order;
+
+	while (start < end) {
+		order = 0;
+		while (order < CM_MAXORDER &&
+		       start % (2U << order) == 0 &&
+		       start + (2U << order) <= end) {
+			order++;
+		}
+		cm_buddyfree(start, order);
+		start += 1U << order;
+	}
+}
+
+/*
+ * Remove a free block of at least order ORDER from the free lists,
+ * splitting it down to exactly ORDER. Returns CM_NONE if there is no
+ * block big enough.
+ */
+static
+uint32_t
+cm_takeblock(unsigned order)
+{
+	uint32_t index;
+	unsigned j;
+
+	for (j = order; j <= CM_MAXORDER; j++) {
+		if (cm_freelist[j] != CM_NONE) {
+			break;
+		}
+	}
+	if (j > CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	index = cm_freelist[j];
+	cm_unlink(index, j);
+	while (j > order) {
+		j--;
+		cm_link(index + (1U << j), j);
+	}
+	return index;
+}
+
+/*
+ * Mark the frames [INDEX, INDEX+NPAGES) allocated as one run.
+ */
+static
+void
+cm_markrun(uint32_t index, unsigned long npages, bool iskern)
+{
+	uint32_t i;
+
+	for (i=0; i<npages; i++) {
+		coremap[index + i].cme_state = iskern ? CME_KERNEL : CME_USER;
+		coremap[index + i].cme_npages = 0;
+		coremap[index + i].cme_refcount = 0;
+		coremap[index + i].cme_pcache = 0;
+		coremap[index + i].cme_as = NULL;
+		coremap[index + i].cme_vaddr = 0;
+	}
+	coremap[index].cme_npages = npages;
+	coremap[index].cme_refcount = 1;
+}
+
+/*
+ * Allocate NPAGES frames from the free lists. Returns CM_NONE if
+ * there is no block big enough. Call with coremap_lock held.
+ */
+static
+uint32_t
+cm_allocrun(unsigned long npages, unsigned order, bool iskern)
+{
+	uint32_t index;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (!iskern && cm_nfree < npages + CM_RESERVE) {
+		return CM_NONE;
+	}
+
+	index = cm_takeblock(order);
+	if (index == CM_NONE) {
+		return CM_NONE;
+	}
+
+	/* Give back whatever of the block we don't need. */
+	if (npages < (1UL << order)) {
+		cm_freerange(index + npages, index + (1U << order));
+	}
+	cm_markrun(index, npages, iskern);
+	cm_nfree -= npages;
+	return index;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu frame caches
+
+/*
+ * Move up to N frames from the top of C's frame cache back to the
+ * free lists. Call with C's c_framecache_lock held.
+ */
+static
+void
+cm_cache_drain(struct cpu *c, unsigned n)
+{
+	uint32_t index;
+
+	KASSERT(spinlock_do_i_hold(&c->c_framecache_lock));
+
+	spinlock_acquire(&coremap_lock);
+	while (n > 0 && c->c_framecache_count > 0) {
+		c->c_framecache_count--;
+		index = (c->c_framecache[c->c_framecache_count] - cm_base)
+			/ PAGE_SIZE;
+		KASSERT(coremap[index].cme_state == CME_CACHED);
+		coremap[index].cme_state = CME_FREE;
+		cm_buddyfree(index, 0);
+		cm_nfree++;
+		n--;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Return every cpu's cached frames to the free lists. Used when the
+ * free lists alone cannot satisfy a request. Takes one frame cache
+ * lock at a time, so it may race with other cpus refilling; that only
+ * costs us the retry.
+ */
+static
+void
+cm_cache_drainall(void)
+{
+	struct cpu *c;
+	unsigned i, n;
+
+	n = cpu_numcpus();
+	for (i=0; i<n; i++) {
+		c = cpu_getcpu(i);
+		spinlock_acquire(&c->c_framecache_lock);
+		cm_cache_drain(c, CPU_FRAMECACHE_SIZE);
+		spinlock_release(&c->c_framecache_lock);
+	}
+}
+
+/*
+ * Allocate one frame from the current cpu's cache, refilling the
+ * cache with CM_BATCH frames from the free lists if it is empty.
+ * Returns CM_NONE if neither has a frame (for users, one above the
+ * reserve).
+ */
+static
+uint32_t
+cm_cache_alloc(bool iskern)
+{
+	struct cpu *c = curcpu;
+	uint32_t index;
+
+	spinlock_acquire(&c->c_framecache_lock);
+
+	if (c->c_framecache_count == 0) {
+		c->c_framecache_misses++;
+		spinlock_acquire(&coremap_lock);
+		while (c->c_framecache_count < CM_BATCH &&
+		       (iskern || cm_nfree > CM_RESERVE)) {
+			index = cm_takeblock(0);
+			if (index == CM_NONE) {
+				break;
+			}
+			coremap[index].cme_state = CME_CACHED;
+			c->c_framecache[c->c_framecache_count++] =
+				cm_base + index * PAGE_SIZE;
+			cm_nfree--;
+		}
+		spinlock_release(&coremap_lock);
+		if (c->c_framecache_count == 0) {
+			spinlock_release(&c->c_framecache_lock);
+			return CM_NONE;
+		}
+	}
+	else {
+		c->c_framecache_hits++;
+	}
+
+	c->c_framecache_count--;
+	index = (c->c_framecache[c->c_framecache_count] - cm_base) / PAGE_SIZE;
+	KASSERT(coremap[index].cme_state == CME_CACHED);
+	cm_markrun(index, 1, iskern);
+
+	spinlock_release(&c->c_framecache_lock);
+	return index;
+}
+
+/*
+ * Put the single frame INDEX, whose coremap entry has already been
+ * cleared, in the current cpu's cache. If the cache is full, first
+ * give half of it back to the free lists.
+ */
+static
+void
+cm_cache_free(uint32_t index)
+{
+	struct cpu *c = curcpu;
+
+	spinlock_acquire(&c->c_framecache_lock);
+	if (c->c_framecache_count == CPU_FRAMECACHE_SIZE) {
+		c->c_framecache_drains++;
+		cm_cache_drain(c, CM_BATCH);
+	}
+	coremap[index].cme_state = CME_CACHED;
+	c->c_framecache[c->c_framecache_count++] = cm_base + index * PAGE_SIZE;
+	spinlock_release(&c->c_framecache_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Zeroed frame pool
+
+/*
+ * Put the zeroed pool, and the frame being zeroed for it if no cpu is
+ * in the middle of it, back on the free lists. Returns true if that
+ * freed anything.
+ */
+static
+bool
+cm_zeroflush(void)
+{
+	uint32_t index;
+	bool any;
+
+	spinlock_acquire(&coremap_lock);
+	any = cm_nzeroed > 0;
+	while (cm_nzeroed > 0) {
+		cm_nzeroed--;
+		index = (cm_zeroed[cm_nzeroed] - cm_base) / PAGE_SIZE;
+		KASSERT(coremap[index].cme_state == CME_ZEROED);
+		coremap[index].cme_state = CME_FREE;
+		cm_buddyfree(index, 0);
+		cm_nfree++;
+	}
+	if (cm_zerocur != CM_NONE && !cm_zerobusy) {
+		KASSERT(coremap[cm_zerocur].cme_state == CME_ZEROED);
+		coremap[cm_zerocur].cme_state = CME_FREE;
+		cm_buddyfree(cm_zerocur, 0);
+		cm_nfree++;
+		cm_zerocur = CM_NONE;
+		any = true;
+	}
+	spinlock_release(&coremap_lock);
+	return any;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned npages, cmpages, i;
+
+	KASSERT(!cm_ready);
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+	KASSERT((hi & PAGE_FRAME) == hi);
+
+	/*
+	 * Put the coremap at the bottom of free memory. It only needs
+	 * to describe the frames left after it, but sizing it for all
+	 * of them is simpler and wastes at most a page.
+	 */
+	npages = (hi - lo) / PAGE_SIZE;
+	cmpages = DIVROUNDUP(npages * sizeof(struct cm_entry), PAGE_SIZE);
+	if (cmpages >= npages) {
+		panic("coremap: not enough memory for the coremap\n");
+	}
+
+	coremap = (struct cm_entry *)PADDR_TO_KVADDR(lo);
+	cm_base = lo + cmpages * PAGE_SIZE;
+	cm_nframes = npages - cmpages;
+
+	for (i=0; i<CM_NORDERS; i++) {
+		cm_freelist[i] = CM_NONE;
+		cm_nblocks[i] = 0;
+	}
+	for (i=0; i<cm_nframes; i++) {
+		coremap[i].cme_next = CM_NONE;
+		coremap[i].cme_prev = CM_NONE;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_zerooff = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_order = 0;
+		coremap[i].cme_state = CME_FREE;
+		coremap[i].cme_pcache = 0;
+	}
+
+	cm_zeromax = cm_nframes / 32;
+	if (cm_zeromax > CM_ZEROMAX) {
+		cm_zeromax = CM_ZEROMAX;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cm_freerange(0, cm_nframes);
+	cm_nfree = cm_nframes;
+	cm_ready = true;
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u frames managed, %uk used by coremap\n",
+		cm_nframes, cmpages * PAGE_SIZE / 1024);
+}
+
+paddr_t
+coremap_alloc(unsigned long npages, bool iskern)
+{
+	uint32_t index;
+	unsigned order;
+
+	KASSERT(cm_ready);
+
+	if (npages == 0) {
+		return 0;
+	}
+
+	if (npages == 1) {
+		index = cm_cache_alloc(iskern);
+		if (index != CM_NONE) {
+			return cm_base + index * PAGE_SIZE;
+		}
+	}
+
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+		if (order > CM_MAXORDER) {
+			return 0;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	index = cm_allocrun(npages, order, iskern);
+	spinlock_release(&coremap_lock);
+
+	if (index == CM_NONE) {
+		/*
+		 * Free frames may be sitting in cpu caches or the
+		 * zeroed pool; try again.
+		 */
+		cm_cache_drainall();
+		cm_zeroflush();
+		spinlock_acquire(&coremap_lock);
+		index = cm_allocrun(npages, order, iskern);
+		spinlock_release(&coremap_lock);
+		if (index == CM_NONE) {
+			return 0;
+		}
+	}
+
+	return cm_base + index * PAGE_SIZE;
+}
+
+paddr_t
+coremap_allocz(void)
+{
+	uint32_t index;
+	paddr_t pa;
+
+	KASSERT(cm_ready);
+
+	spinlock_acquire(&coremap_lock);
+	if (cm_nzeroed > 0) {
+		cm_nzeroed--;
+		pa = cm_zeroed[cm_nzeroed];
+		index = (pa - cm_base) / PAGE_SIZE;
+		KASSERT(coremap[index].cme_state == CME_ZEROED);
+		cm_markrun(index, 1, false);
+		cm_zerohits++;
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+	cm_zeromisses++;
+	spinlock_release(&coremap_lock);
+
+	pa = coremap_alloc(1, false);
+	if (pa != 0) {
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	}
+	return pa;
+}
+
+bool
+coremap_zeroidle(void)
+{
+	uint32_t index;
+	unsigned off;
+	paddr_t pa;
+
+	if (!cm_ready) {
+		return false;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (cm_zerobusy) {
+		/* Another idle cpu has it in hand. */
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	if (cm_zerocur == CM_NONE) {
+		if (cm_nzeroed >= cm_zeromax || cm_nfree <= CM_ZEROSLACK) {
+			spinlock_release(&coremap_lock);
+			return false;
+		}
+		index = cm_takeblock(0);
+		if (index == CM_NONE) {
+			spinlock_release(&coremap_lock);
+			return false;
+		}
+		coremap[index].cme_state = CME_ZEROED;
+		coremap[index].cme_zerooff = 0;
+		cm_nfree--;
+		cm_zerocur = index;
+	}
+	index = cm_zerocur;
+	off = coremap[index].cme_zerooff;
+	cm_zerobusy = true;
+	spinlock_release(&coremap_lock);
+
+	pa = cm_base + index * PAGE_SIZE;
+	bzero((void *)(PADDR_TO_KVADDR(pa) + off), CM_ZEROCHUNK);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cm_zerocur == index);
+	cm_zerobusy = false;
+	off += CM_ZEROCHUNK;
+	coremap[index].cme_zerooff = off;
+	if (off == PAGE_SIZE) {
+		cm_zeroed[cm_nzeroed++] = pa;
+		cm_zerocur = CM_NONE;
+	}
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+/*
+ * Drop a reference to the run at INDEX, freeing it if it was the
+ * last. Call with coremap_lock held; releases it.
+ */
+static
+void
+cm_release(uint32_t index)
+{
+	uint32_t npages, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	npages = coremap[index].cme_npages;
+	KASSERT(index + npages <= cm_nframes);
+
+	KASSERT(coremap[index].cme_refcount > 0);
+	coremap[index].cme_refcount--;
+	if (coremap[index].cme_refcount > 0) {
+		/* Still shared. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	for (i=0; i<npages; i++) {
+		KASSERT(coremap[index + i].cme_state == CME_KERNEL ||
+			coremap[index + i].cme_state == CME_USER);
+		coremap[index + i].cme_state = CME_FREE;
+		coremap[index + i].cme_npages = 0;
+		coremap[index + i].cme_as = NULL;
+	}
+
+	if (npages == 1) {
+		/*
+		 * Mark it cached before dropping the lock so nobody can
+		 * coalesce it into a buddy block in between.
+		 */
+		coremap[index].cme_state = CME_CACHED;
+		spinlock_release(&coremap_lock);
+		cm_cache_free(index);
+		return;
+	}
+
+	cm_freerange(index, index + npages);
+	cm_nfree += npages;
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Find the coremap entry for the run starting at PA. Call with
+ * coremap_lock held.
+ */
+static
+struct cm_entry *
+cm_runentry(paddr_t pa)
+{
+	uint32_t index;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT((pa & PAGE_FRAME) == pa);
+	KASSERT(pa >= cm_base);
+
+	index = (pa - cm_base) / PAGE_SIZE;
+	KASSERT(index < cm_nframes);
+	if (coremap[index].cme_npages == 0) {
+		panic("coremap: 0x%x is not the start of an allocated run\n",
+		      pa);
+	}
+	return &coremap[index];
+}
+
+void
+coremap_free(paddr_t pa)
+{
+	struct cm_entry *e;
+
+	KASSERT(cm_ready);
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runentry(pa);
+	if (e->cme_pcache) {
+		/* The page cache letting go. */
+		KASSERT(e->cme_state == CME_USER);
+		e->cme_pcache = 0;
+	}
+	cm_release(e - coremap);
+}
+
+/*
+ * Add one sharer to the run at PA, checking for overflow. Call with
+ * coremap_lock held.
+ */
+static
+struct cm_entry *
+cm_addref(paddr_t pa)
+{
+	struct cm_entry *e;
+
+	e = cm_runentry(pa);
+	KASSERT(e->cme_state == CME_USER);
+	KASSERT(e->cme_npages == 1);
+	KASSERT(e->cme_refcount > 0);
+	if (e->cme_refcount == 0xffff) {
+		panic("coremap: too many sharers of 0x%x\n", pa);
+	}
+	e->cme_refcount++;
+	return e;
+}
+
+void
+coremap_share(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	struct cm_entry *e;
+
+	KASSERT(cm_ready);
+	KASSERT(as != NULL);
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_addref(pa);
+	e->cme_as = (struct addrspace *)((uintptr_t)e->cme_as ^
+					 (uintptr_t)as);
+	e->cme_vaddr ^= vaddr;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_unshare(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	struct cm_entry *e;
+
+	KASSERT(cm_ready);
+	KASSERT(as != NULL);
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runentry(pa);
+	KASSERT(e->cme_state == CME_USER);
+	KASSERT(CM_MAPPERS(e) > 0);
+	e->cme_as = (struct addrspace *)((uintptr_t)e->cme_as ^
+					 (uintptr_t)as);
+	e->cme_vaddr ^= vaddr;
+	cm_release(e - coremap);
+}
+
+void
+coremap_pcshare(paddr_t pa)
+{
+	struct cm_entry *e;
+
+	KASSERT(cm_ready);
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_addref(pa);
+	KASSERT(!e->cme_pcache);
+	e->cme_pcache = 1;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t pa)
+{
+	unsigned ret;
+
+	KASSERT(cm_ready);
+
+	spinlock_acquire(&coremap_lock);
+	ret = cm_runentry(pa)->cme_refcount;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+unsigned
+coremap_nframes(void)
+{
+	KASSERT(cm_ready);
+	return cm_nframes;
+}
+
+void
+coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	struct cm_entry *e;
+
+	KASSERT(cm_ready);
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runentry(pa);
+	KASSERT(e->cme_state == CME_USER);
+	KASSERT(e->cme_npages == 1);
+	KASSERT(e->cme_refcount == 1);
+	e->cme_as = as;
+	e->cme_vaddr = vaddr;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_clock(bool (*visit)(struct addrspace *as, vaddr_t vaddr,
+			    paddr_t pa, bool pcache, void *data),
+	      void *data)
+{
+	struct cm_entry *e;
+	uint32_t index;
+	unsigned i;
+
+	KASSERT(cm_ready);
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<2*cm_nframes; i++) {
+		index = cm_hand;
+		cm_hand = (cm_hand + 1) % cm_nframes;
+		e = &coremap[index];
+		if (e->cme_state != CME_USER || e->cme_npages != 1 ||
+		    CM_MAPPERS(e) != 1 || e->cme_as == NULL) {
+			continue;
+		}
+		if (visit(e->cme_as, e->cme_vaddr,
+			  cm_base + index * PAGE_SIZE, e->cme_pcache, data)) {
+			break;
+		}
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_printstats(void)
+{
+	unsigned nblocks[CM_NORDERS];
+	unsigned nframes, nfree, nkernel, nuser, ncached, nshared, npageable;
+	unsigned nfrag, nzeroed, zerohits, zeromisses;
+	unsigned i, ncpus;
+	struct cpu *c;
+
+	if (!cm_ready) {
+		kprintf("coremap: not initialized\n");
+		return;
+	}
+
+	/*
+	 * Take a snapshot, then print it without the lock held. The
+	 * kernel/user split needs a scan of the coremap; frames moving
+	 * in and out of cpu caches meanwhile can make it slightly off.
+	 */
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<CM_NORDERS; i++) {
+		nblocks[i] = cm_nblocks[i];
+	}
+	nframes = cm_nframes;
+	nfree = cm_nfree;
+	nzeroed = cm_nzeroed;
+	zerohits = cm_zerohits;
+	zeromisses = cm_zeromisses;
+	nkernel = nuser = ncached = nshared = npageable = 0;
+	for (i=0; i<nframes; i++) {
+		switch (coremap[i].cme_state) {
+		    case CME_KERNEL: nkernel++; break;
+		    case CME_USER: nuser++; break;
+		    case CME_CACHED: ncached++; break;
+		}
+		if (coremap[i].cme_state != CME_USER ||
+		    coremap[i].cme_npages != 1) {
+			continue;
+		}
+		if (CM_MAPPERS(&coremap[i]) > 1) {
+			nshared++;
+		}
+		else if (CM_MAPPERS(&coremap[i]) == 1 &&
+			 coremap[i].cme_as != NULL) {
+			npageable++;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	nfrag = 0;
+	for (i=0; i<CM_FRAGORDER; i++) {
+		nfrag += nblocks[i] << i;
+	}
+
+	kprintf("Coremap: %u frames, %u free (%u in cpu caches, %u zeroed), "
+		"%u used (%u kernel, %u user)\n",
+		nframes, nfree + ncached + nzeroed, ncached, nzeroed,
+		nkernel + nuser, nkernel, nuser);
+	kprintf("Coremap: zeroed pool: %u hits, %u misses\n",
+		zerohits, zeromisses);
+	kprintf("Coremap: %u user frames pageable, %u mapped more than once\n",
+		npageable, nshared);
+	kprintf("Coremap: %u free frames fragmented (in runs of < %u pages)\n",
+		nfrag, 1U << CM_FRAGORDER);
+	kprintf("Coremap: free blocks by order:");
+	for (i=0; i<CM_NORDERS; i++) {
+		kprintf(" %u", nblocks[i]);
+	}
+	kprintf("\n");
+
+	ncpus = cpu_numcpus();
+	for (i=0; i<ncpus; i++) {
+		c = cpu_getcpu(i);
+		kprintf("Coremap: cpu%u frame cache: %u cached, %u hits, "
+			"%u misses, %u drains\n", c->c_number,
+			c->c_framecache_count, c->c_framecache_hits,
+			c->c_framecache_misses, c->c_framecache_drains);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Kernel page allocation (called by kmalloc/kfree)
+
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	if (!cm_ready) {
+		/*
+		 * Too early for the coremap; steal the memory. It is
+		 * never given back (see free_kpages).
+		 */
+		spinlock_acquire(&coremap_lock);
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+	}
+	else {
+		pa = coremap_alloc(npages, true);
+	}
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	paddr_t pa;
+
+	KASSERT(addr >= MIPS_KSEG0);
+	pa = KVADDR_TO_PADDR(addr);
+
+	if (!cm_ready || pa < cm_base) {
+		/* Stolen before the coremap existed; leak it. */
+		return;
+	}
+	coremap_free(pa);
+}
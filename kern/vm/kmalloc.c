@@ -31,6 +31,8 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include <kmem.h>
+#include "opt-kmallocdebug.h"
 
 /*
  * Kernel malloc.
@@ -75,8 +77,16 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    Each size has its own list of pages and its own lock, so
+//    allocations of different sizes don't contend. kfree finds the
+//    page a block is on through a hash table on the page address,
+//    rather than searching every page.
+//
 
-#undef  SLOW	/* consistency checks */
+/* Consistency checks; "options kmallocdebug" in the kernel config. */
+#if OPT_KMALLOCDEBUG
+#define SLOW
+#endif
 #undef SLOWER	/* lots of consistency checks */
 
 ////////////////////////////////////////
@@ -103,7 +113,7 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *next_hash;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -141,13 +151,47 @@ static struct pageref pagerefs[NPAGEREFS];
 #define INUSE_WORDS (NPAGEREFS/32)
 static uint32_t pagerefs_inuse[INUSE_WORDS];
 
+/*
+ * Pagerefs in use, hashed on page address. With one bucket per
+ * pageref the chains stay about one long.
+ */
+#define PR_HASHSIZE NPAGEREFS
+#define PR_HASH(pa) (((pa) / PAGE_SIZE) % PR_HASHSIZE)
+static struct pageref *pagerefs_hash[PR_HASHSIZE];
+
+////////////////////////////////////////
+
+/*
+ * One lock per size, for its entry in sizebases[] and the pages on
+ * that list. Another lock covers pagerefs_inuse[] and the hash table;
+ * it may be taken while holding a size lock, but not the other way
+ * round.
+ */
+
+static struct pageref *sizebases[NSIZES];
+static struct spinlock sizelocks[NSIZES] = {
+	SPINLOCK_INITIALIZER, SPINLOCK_INITIALIZER,
+	SPINLOCK_INITIALIZER, SPINLOCK_INITIALIZER,
+	SPINLOCK_INITIALIZER, SPINLOCK_INITIALIZER,
+	SPINLOCK_INITIALIZER, SPINLOCK_INITIALIZER,
+};
+static struct spinlock pageref_spinlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////
+
+/*
+ * Get a pageref for the page at PRPAGE, to hold blocks of type
+ * BLKTYPE, and enter it in the hash table.
+ */
 static
 struct pageref *
-allocpageref(void)
+allocpageref(vaddr_t prpage, int blktype)
 {
+	struct pageref *pr;
 	unsigned i,j;
 	uint32_t k;
 
+	spinlock_acquire(&pageref_spinlock);
 	for (i=0; i<INUSE_WORDS; i++) {
 		if (pagerefs_inuse[i]==0xffffffff) {
 			/* full */
@@ -156,11 +200,18 @@ allocpageref(void)
 		for (k=1,j=0; k!=0; k<<=1,j++) {
 			if ((pagerefs_inuse[i] & k)==0) {
 				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+				pr = &pagerefs[i*32 + j];
+				pr->pageaddr_and_blocktype =
+					MKPAB(prpage, blktype);
+				pr->next_hash = pagerefs_hash[PR_HASH(prpage)];
+				pagerefs_hash[PR_HASH(prpage)] = pr;
+				spinlock_release(&pageref_spinlock);
+				return pr;
 			}
 		}
 		KASSERT(0);
 	}
+	spinlock_release(&pageref_spinlock);
 
 	/* ran out */
 	return NULL;
@@ -170,6 +221,7 @@ static
 void
 freepageref(struct pageref *p)
 {
+	struct pageref **guy;
 	size_t i, j;
 	uint32_t k;
 
@@ -177,25 +229,40 @@ freepageref(struct pageref *p)
 	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
+
+	spinlock_acquire(&pageref_spinlock);
 	KASSERT((pagerefs_inuse[i] & k) != 0);
+	for (guy = &pagerefs_hash[PR_HASH(PR_PAGEADDR(p))]; *guy != p;
+	     guy = &(*guy)->next_hash) {
+		KASSERT(*guy != NULL);
+	}
+	*guy = p->next_hash;
 	pagerefs_inuse[i] &= ~k;
+	spinlock_release(&pageref_spinlock);
 }
 
-////////////////////////////////////////
-
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
-
-////////////////////////////////////////
-
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Find the pageref for the page PTR is on, or NULL if it isn't on a
+ * subpage allocator page.
  */
+static
+struct pageref *
+findpageref(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+	prpage = ptraddr & PAGE_FRAME;
+	spinlock_acquire(&pageref_spinlock);
+	for (pr = pagerefs_hash[PR_HASH(prpage)]; pr != NULL;
+	     pr = pr->next_hash) {
+		if (PR_PAGEADDR(pr) == prpage) {
+			break;
+		}
+	}
+	spinlock_release(&pageref_spinlock);
+	return pr;
+}
 
 ////////////////////////////////////////
 
@@ -216,7 +283,7 @@ checksubpage(struct pageref *pr)
 	int blktype;
 	int nfree=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(spinlock_do_i_hold(&sizelocks[PR_BLOCKTYPE(pr)]));
 
 	if (pr->freelist_offset == INVALID_OFFSET) {
 		KASSERT(pr->nfree==0);
@@ -249,32 +316,23 @@ checksubpage(struct pageref *pr)
 #ifdef SLOWER
 static
 void
-checksubpages(void)
+checksubpages(int blktype)
 {
 	struct pageref *pr;
-	int i;
-	unsigned sc=0, ac=0;
+	unsigned sc=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(spinlock_do_i_hold(&sizelocks[blktype]));
 
-	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
-			sc++;
-		}
-	}
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == (unsigned)blktype);
+		KASSERT(findpageref(PR_PAGEADDR(pr)) == pr);
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+		KASSERT(sc < NPAGEREFS);
+		sc++;
 	}
-
-	KASSERT(sc==ac);
 }
 #else
-#define checksubpages() 
+#define checksubpages(blktype) ((void)(blktype))
 #endif
 
 ////////////////////////////////////////
@@ -290,7 +348,7 @@ dumpsubpage(struct pageref *pr)
 	uint32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
 
 	checksubpage(pr);
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(spinlock_do_i_hold(&sizelocks[PR_BLOCKTYPE(pr)]));
 
 	/* clear freemap[] */
 	for (i=0; i<sizeof(freemap)/sizeof(freemap[0]); i++) {
@@ -330,21 +388,27 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+/* In the large-block section below. */
+static void large_printstats(void);
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
-
-	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
+	int i;
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
+	/* print each size with interrupts off */
+	for (i=0; i<NSIZES; i++) {
+		spinlock_acquire(&sizelocks[i]);
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			dumpsubpage(pr);
+		}
+		spinlock_release(&sizelocks[i]);
 	}
 
-	spinlock_release(&kmalloc_spinlock);
+	large_printstats();
 }
 
 ////////////////////////////////////////
@@ -364,14 +428,6 @@ remove_lists(struct pageref *pr, int blktype)
 			break;
 		}
 	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
-	}
 }
 
 static
@@ -409,14 +465,14 @@ subpage_kmalloc(size_t sz)
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
 
-	spinlock_acquire(&kmalloc_spinlock);
+	spinlock_acquire(&sizelocks[blktype]);
 
-	checksubpages();
+	checksubpages(blktype);
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
 		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		KASSERT(PR_BLOCKTYPE(pr) == (unsigned)blktype);
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
@@ -443,9 +499,9 @@ subpage_kmalloc(size_t sz)
 				pr->freelist_offset = INVALID_OFFSET;
 			}
 
-			checksubpages();
+			checksubpages(blktype);
 
-			spinlock_release(&kmalloc_spinlock);
+			spinlock_release(&sizelocks[blktype]);
 			return retptr;
 		}
 	}
@@ -459,25 +515,24 @@ subpage_kmalloc(size_t sz)
 	 * Note that this means things can change behind our back...
 	 */
 
-	spinlock_release(&kmalloc_spinlock);
+	spinlock_release(&sizelocks[blktype]);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
 	}
-	spinlock_acquire(&kmalloc_spinlock);
+	spinlock_acquire(&sizelocks[blktype]);
 
-	pr = allocpageref();
+	pr = allocpageref(prpage, blktype);
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
+		spinlock_release(&sizelocks[blktype]);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
 		return NULL;
 	}
 
-	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
 
 	/*
@@ -501,9 +556,6 @@ subpage_kmalloc(size_t sz)
 	pr->next_samesize = sizebases[blktype];
 	sizebases[blktype] = pr;
 
-	pr->next_all = allbase;
-	allbase = pr;
-
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -522,28 +574,25 @@ subpage_kfree(void *ptr)
 
 	ptraddr = (vaddr_t)ptr;
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	/*
+	 * The page can't go away under us: it has at least one block
+	 * allocated, the one being freed.
+	 */
+	pr = findpageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	spinlock_acquire(&sizelocks[blktype]);
+
+	checksubpages(blktype);
+	checksubpage(pr);
 
 	offset = ptraddr - prpage;
 
@@ -578,33 +627,398 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
+		/* Call free_kpages without the size lock. */
+		spinlock_release(&sizelocks[blktype]);
 		free_kpages(prpage);
 	}
 	else {
-		spinlock_release(&kmalloc_spinlock);
+		spinlock_release(&sizelocks[blktype]);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
+	spinlock_acquire(&sizelocks[blktype]);
+	checksubpages(blktype);
+	spinlock_release(&sizelocks[blktype]);
 #endif
 
 	return 0;
 }
 
+//
+////////////////////////////////////////////////////////////
+//
+// Large-block allocator.
+//
+//    Sizes just over a page boundary waste most of a page when
+//    rounded up to whole pages: a 2.5K buffer takes 4K, a 5K one 8K.
+//    For those, and for 12K blocks, we carve 3-page (12K) runs into
+//    blocks of 3K, 6K and 12K, managed buddy-fashion: a run is split
+//    in halves as needed, and a freed block merges with its free
+//    buddy, so that a run whose blocks are all free becomes one 12K
+//    block again. A few such idle runs are kept for reuse, so that
+//    big buffers don't take fresh frames each time; the rest go back
+//    to the page allocator.
+//
+//    Runs are described by runrefs, which like pagerefs come from a
+//    fixed table and are hashed on the run's base address. Everything
+//    here is under one lock; large allocations are much rarer than
+//    small ones.
+//
+
+#define LARGE_NORDERS    3
+#define LARGE_RUNPAGES   3
+#define LARGE_NGRAINS    4	/* smallest blocks per run */
+#define LARGE_KEEPRUNS   2	/* idle runs to keep */
+
+static const size_t largesizes[LARGE_NORDERS] = { 3072, 6144, 12288 };
+
+struct largefree {
+	struct largefree *next;
+	struct largefree *prev;
+};
+
+struct runref {
+	vaddr_t rr_base;		/* 0 if not in use */
+	struct runref *rr_next;		/* hash chain */
+	uint8_t rr_order[LARGE_NGRAINS];	/* order of block at each grain */
+	uint8_t rr_start;		/* mask of grains that start a block */
+	uint8_t rr_free;		/* mask of grains that start a free one */
+};
+
+#define NRUNREFS 64
+#define RR_HASHSIZE NRUNREFS
+#define RR_HASH(va) (((va) / PAGE_SIZE) % RR_HASHSIZE)
+
+static struct runref runrefs[NRUNREFS];
+static struct runref *runrefs_hash[RR_HASHSIZE];
+static struct largefree *largefree[LARGE_NORDERS];
+static unsigned large_nruns, large_nidle;
+static struct spinlock large_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Choose the block order for a request of SZ bytes, or return -1 if
+ * it is better off as whole pages: only use a class that wastes no
+ * more than rounding up to pages would.
+ */
+static
+int
+largeorder(size_t sz)
+{
+	size_t pagesz;
+	int i;
+
+	pagesz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+	for (i=0; i<LARGE_NORDERS; i++) {
+		if (sz <= largesizes[i] && largesizes[i] <= pagesz) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static
+void
+large_push(unsigned order, vaddr_t va)
+{
+	struct largefree *lf = (struct largefree *)va;
+
+	lf->prev = NULL;
+	lf->next = largefree[order];
+	if (lf->next != NULL) {
+		lf->next->prev = lf;
+	}
+	largefree[order] = lf;
+}
+
+static
+void
+large_unlink(unsigned order, vaddr_t va)
+{
+	struct largefree *lf = (struct largefree *)va;
+
+	if (lf->prev != NULL) {
+		lf->prev->next = lf->next;
+	}
+	else {
+		KASSERT(largefree[order] == lf);
+		largefree[order] = lf->next;
+	}
+	if (lf->next != NULL) {
+		lf->next->prev = lf->prev;
+	}
+}
+
+/*
+ * Find the run the block at VA is in. A block starts on a grain, so
+ * the run starts on one of the LARGE_RUNPAGES pages at or below it.
+ */
+static
+struct runref *
+large_findrun(vaddr_t va)
+{
+	struct runref *rr;
+	vaddr_t base;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&large_spinlock));
+
+	base = va & PAGE_FRAME;
+	for (i=0; i<LARGE_RUNPAGES; i++, base -= PAGE_SIZE) {
+		for (rr = runrefs_hash[RR_HASH(base)]; rr != NULL;
+		     rr = rr->rr_next) {
+			if (rr->rr_base == base) {
+				return rr;
+			}
+		}
+	}
+	return NULL;
+}
+
+static
+struct runref *
+large_newrun(vaddr_t base)
+{
+	struct runref *rr;
+	unsigned i;
+
+	for (i=0; i<NRUNREFS; i++) {
+		rr = &runrefs[i];
+		if (rr->rr_base == 0) {
+			rr->rr_base = base;
+			rr->rr_next = runrefs_hash[RR_HASH(base)];
+			runrefs_hash[RR_HASH(base)] = rr;
+			large_nruns++;
+			return rr;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+large_freerun(struct runref *rr)
+{
+	struct runref **guy;
+
+	for (guy = &runrefs_hash[RR_HASH(rr->rr_base)]; *guy != rr;
+	     guy = &(*guy)->rr_next) {
+		KASSERT(*guy != NULL);
+	}
+	*guy = rr->rr_next;
+	rr->rr_base = 0;
+	large_nruns--;
+}
+
+/*
+ * Mark the block of order ORDER at grain G of RR as a block, free or
+ * not.
+ */
+static
+void
+large_mark(struct runref *rr, unsigned g, unsigned order, bool isfree)
+{
+	rr->rr_start |= 1 << g;
+	rr->rr_order[g] = order;
+	if (isfree) {
+		rr->rr_free |= 1 << g;
+	}
+	else {
+		rr->rr_free &= ~(1 << g);
+	}
+}
+
+static
+void *
+large_kmalloc(unsigned order)
+{
+	struct runref *rr;
+	vaddr_t va, base;
+	unsigned o, g;
+
+	spinlock_acquire(&large_spinlock);
+
+	for (o = order; o < LARGE_NORDERS; o++) {
+		if (largefree[o] != NULL) {
+			break;
+		}
+	}
+	if (o == LARGE_NORDERS) {
+		/* Need a new run; get it without the lock. */
+		spinlock_release(&large_spinlock);
+		base = alloc_kpages(LARGE_RUNPAGES);
+		if (base == 0) {
+			return NULL;
+		}
+		spinlock_acquire(&large_spinlock);
+		rr = large_newrun(base);
+		if (rr == NULL) {
+			spinlock_release(&large_spinlock);
+			free_kpages(base);
+			kprintf("kmalloc: Large allocator couldn't get runref\n");
+			return NULL;
+		}
+		rr->rr_start = rr->rr_free = 0;
+		va = base;
+		o = LARGE_NORDERS - 1;
+		g = 0;
+	}
+	else {
+		va = (vaddr_t)largefree[o];
+		large_unlink(o, va);
+		rr = large_findrun(va);
+		KASSERT(rr != NULL);
+		g = (va - rr->rr_base) / largesizes[0];
+		if (o == LARGE_NORDERS - 1) {
+			large_nidle--;
+		}
+	}
+
+	/* Split off and free the upper halves until it's the right size. */
+	while (o > order) {
+		o--;
+		large_mark(rr, g + (1 << o), o, true);
+		large_push(o, va + largesizes[o]);
+	}
+	large_mark(rr, g, order, false);
+
+	spinlock_release(&large_spinlock);
+	return (void *)va;
+}
+
+/*
+ * Free a large block. Returns -1 if PTR isn't one.
+ */
+static
+int
+large_kfree(void *ptr)
+{
+	struct runref *rr;
+	vaddr_t va, base;
+	unsigned g, bg, order, offset;
+
+	va = (vaddr_t)ptr;
+
+	spinlock_acquire(&large_spinlock);
+
+	rr = large_findrun(va);
+	if (rr == NULL) {
+		spinlock_release(&large_spinlock);
+		return -1;
+	}
+
+	offset = va - rr->rr_base;
+	g = offset / largesizes[0];
+	if (offset % largesizes[0] != 0 || (rr->rr_start & (1 << g)) == 0 ||
+	    (rr->rr_free & (1 << g)) != 0) {
+		panic("kfree: large free of invalid addr %p\n", ptr);
+	}
+	order = rr->rr_order[g];
+
+	fill_deadbeef(ptr, largesizes[order]);
+
+	/* Merge with free buddies as far as they go. */
+	while (order < LARGE_NORDERS - 1) {
+		bg = g ^ (1 << order);
+		if ((rr->rr_free & (1 << bg)) == 0 ||
+		    rr->rr_order[bg] != order) {
+			break;
+		}
+		large_unlink(order, rr->rr_base + bg * largesizes[0]);
+		rr->rr_start &= ~((1 << g) | (1 << bg));
+		rr->rr_free &= ~(1 << bg);
+		if (bg < g) {
+			g = bg;
+		}
+		order++;
+	}
+
+	if (order == LARGE_NORDERS - 1 && large_nidle >= LARGE_KEEPRUNS) {
+		/* Enough idle runs already; give this one back. */
+		base = rr->rr_base;
+		large_freerun(rr);
+		spinlock_release(&large_spinlock);
+		free_kpages(base);
+		return 0;
+	}
+
+	large_mark(rr, g, order, true);
+	large_push(order, rr->rr_base + g * largesizes[0]);
+	if (order == LARGE_NORDERS - 1) {
+		large_nidle++;
+	}
+	spinlock_release(&large_spinlock);
+	return 0;
+}
+
+/*
+ * Give all idle runs back to the page allocator. Returns how many
+ * there were.
+ */
+static
+unsigned
+large_trim(void)
+{
+	struct runref *rr;
+	vaddr_t va;
+	unsigned n;
+
+	n = 0;
+	spinlock_acquire(&large_spinlock);
+	while (largefree[LARGE_NORDERS - 1] != NULL) {
+		va = (vaddr_t)largefree[LARGE_NORDERS - 1];
+		large_unlink(LARGE_NORDERS - 1, va);
+		large_nidle--;
+		rr = large_findrun(va);
+		KASSERT(rr != NULL && rr->rr_base == va);
+		large_freerun(rr);
+		spinlock_release(&large_spinlock);
+		free_kpages(va);
+		n++;
+		spinlock_acquire(&large_spinlock);
+	}
+	spinlock_release(&large_spinlock);
+	return n;
+}
+
+static
+void
+large_printstats(void)
+{
+	struct largefree *lf;
+	unsigned i, n;
+
+	spinlock_acquire(&large_spinlock);
+	kprintf("Large allocator: %u runs, %u idle; free blocks:",
+		large_nruns, large_nidle);
+	for (i=0; i<LARGE_NORDERS; i++) {
+		n = 0;
+		for (lf = largefree[i]; lf != NULL; lf = lf->next) {
+			n++;
+		}
+		kprintf(" %luK x %u", (unsigned long)largesizes[i] / 1024, n);
+	}
+	kprintf("\n");
+	spinlock_release(&large_spinlock);
+}
+
 //
 ////////////////////////////////////////////////////////////
 
+static
 void *
-kmalloc(size_t sz)
+kmalloc_try(size_t sz)
 {
+	int order;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
+		order = largeorder(sz);
+		if (order >= 0) {
+			return large_kmalloc(order);
+		}
+
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
@@ -618,15 +1032,39 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+void *
+kmalloc(size_t sz)
+{
+	void *ptr;
+
+	ptr = kmalloc_try(sz);
+	if (ptr == NULL && kheap_trim()) {
+		/* Objects and runs sitting idle may help. */
+		ptr = kmalloc_try(sz);
+	}
+	return ptr;
+}
+
+bool
+kheap_trim(void)
+{
+	unsigned n;
+
+	n = kmem_reap();
+	n += large_trim();
+	return n > 0;
+}
+
 void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try subpage first, then large blocks; if both fail, assume
+	 * it's whole pages.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	} else if (subpage_kfree(ptr) && large_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
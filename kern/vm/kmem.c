@@ -0,0 +1,440 @@
+/*
+ * Object caches with per-cpu magazines. See kmem.h for the interface.
+ *
+ * Each cpu's part of a cache is touched only by that cpu, at splhigh
+ * so that it can't be switched away in the middle. Trading magazines
+ * with the depot takes the cache's spinlock. kmalloc is never called
+ * with the spinlock held, since it may call kmem_reap, which takes it.
+ *
+ * The cpu layer keeps the two magazines in "loaded" and "prev". On
+ * allocation, objects come from loaded; when it is empty, prev is
+ * tried (it is always either full or empty), then the depot. Frees
+ * work the other way round. The depot keeps at most KMEM_DEPOTMAX full
+ * magazines; beyond that, a full magazine's objects go back to kfree.
+ *
+ * Only its own cpu may touch a cpu's magazines, so kmem_reap can't
+ * empty them directly. It bumps the cache's reap generation instead,
+ * and each cpu frees what its magazines hold the next time it uses the
+ * cache and sees the generation has changed (kmem_cpu_reap).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <kmem.h>
+
+struct kmem_magazine {
+	struct kmem_magazine *m_next;	/* on the depot lists */
+	unsigned m_rounds;		/* objects in m_objs */
+	void *m_objs[KMEM_MAGSIZE];
+};
+
+struct kmem_cpu {
+	struct kmem_magazine *kcc_loaded;
+	struct kmem_magazine *kcc_prev;
+	unsigned kcc_reapgen;		/* kc_reapgen when last drained */
+	unsigned kcc_hits;		/* served without the depot lock */
+	unsigned kcc_misses;		/* had to go to the depot */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	void (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+
+	struct spinlock kc_lock;	/* for the depot and counts */
+	struct kmem_magazine *kc_full;
+	struct kmem_magazine *kc_empty;
+	unsigned kc_nfull, kc_nempty;
+	unsigned kc_allocs;		/* objects obtained from kmalloc */
+	unsigned kc_reaped;		/* objects given back to kfree */
+	unsigned kc_reapgen;		/* bumped by kmem_reap */
+
+	struct kmem_cpu kc_cpu[MAXCPUS];
+};
+
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj),
+		  void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned i;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nfull = kc->kc_nempty = 0;
+	kc->kc_allocs = kc->kc_reaped = 0;
+	kc->kc_reapgen = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		kc->kc_cpu[i].kcc_loaded = NULL;
+		kc->kc_cpu[i].kcc_prev = NULL;
+		kc->kc_cpu[i].kcc_reapgen = 0;
+		kc->kc_cpu[i].kcc_hits = 0;
+		kc->kc_cpu[i].kcc_misses = 0;
+	}
+
+	spinlock_acquire(&kmem_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_lock);
+
+	return kc;
+}
+
+/*
+ * Get a new object from kmalloc and construct it.
+ */
+static
+void *
+kmem_newobj(struct kmem_cache *kc)
+{
+	void *obj;
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		kc->kc_ctor(obj);
+	}
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+/*
+ * Destroy an object and give it back to kfree.
+ */
+static
+void
+kmem_freeobj(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Destroy the objects in a magazine and free it. Returns the number of
+ * objects.
+ */
+static
+unsigned
+kmem_freemag(struct kmem_cache *kc, struct kmem_magazine *mag)
+{
+	unsigned i, n;
+
+	if (mag == NULL) {
+		return 0;
+	}
+	n = mag->m_rounds;
+	for (i=0; i<n; i++) {
+		kmem_freeobj(kc, mag->m_objs[i]);
+	}
+	kfree(mag);
+	return n;
+}
+
+/*
+ * If kmem_reap has run since the current cpu last looked, free what
+ * its magazines hold. Returns the number of objects freed.
+ */
+static
+unsigned
+kmem_cpu_reap(struct kmem_cache *kc)
+{
+	struct kmem_cpu *kcc;
+	struct kmem_magazine *loaded, *prev;
+	unsigned n;
+	int spl;
+
+	/* Cheap check first; usually nothing has happened. */
+	if (kc->kc_cpu[curcpu->c_number].kcc_reapgen == kc->kc_reapgen) {
+		return 0;
+	}
+
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAXCPUS);
+	kcc = &kc->kc_cpu[curcpu->c_number];
+	if (kcc->kcc_reapgen == kc->kc_reapgen) {
+		splx(spl);
+		return 0;
+	}
+	kcc->kcc_reapgen = kc->kc_reapgen;
+	loaded = kcc->kcc_loaded;
+	prev = kcc->kcc_prev;
+	kcc->kcc_loaded = kcc->kcc_prev = NULL;
+	splx(spl);
+
+	n = kmem_freemag(kc, loaded) + kmem_freemag(kc, prev);
+	if (n > 0) {
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_reaped += n;
+		spinlock_release(&kc->kc_lock);
+	}
+	return n;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_cpu *kcc;
+	struct kmem_magazine *mag;
+	void *obj;
+	int spl;
+
+	/* Early in boot there is no curcpu to find our magazines by. */
+	if (!CURCPU_EXISTS()) {
+		return kmem_newobj(kc);
+	}
+	kmem_cpu_reap(kc);
+
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAXCPUS);
+	kcc = &kc->kc_cpu[curcpu->c_number];
+	while (1) {
+		mag = kcc->kcc_loaded;
+		if (mag != NULL && mag->m_rounds > 0) {
+			obj = mag->m_objs[--mag->m_rounds];
+			kcc->kcc_hits++;
+			splx(spl);
+			return obj;
+		}
+		if (kcc->kcc_prev != NULL && kcc->kcc_prev->m_rounds > 0) {
+			kcc->kcc_loaded = kcc->kcc_prev;
+			kcc->kcc_prev = mag;
+			continue;
+		}
+
+		/* Both empty; trade the previous one for a full one. */
+		kcc->kcc_misses++;
+		spinlock_acquire(&kc->kc_lock);
+		mag = kc->kc_full;
+		if (mag == NULL) {
+			spinlock_release(&kc->kc_lock);
+			break;
+		}
+		kc->kc_full = mag->m_next;
+		kc->kc_nfull--;
+		if (kcc->kcc_prev != NULL) {
+			kcc->kcc_prev->m_next = kc->kc_empty;
+			kc->kc_empty = kcc->kcc_prev;
+			kc->kc_nempty++;
+		}
+		spinlock_release(&kc->kc_lock);
+		kcc->kcc_prev = kcc->kcc_loaded;
+		kcc->kcc_loaded = mag;
+	}
+	splx(spl);
+
+	return kmem_newobj(kc);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_cpu *kcc;
+	struct kmem_magazine *mag, *spill;
+	unsigned i, n;
+	int spl;
+
+	KASSERT(obj != NULL);
+
+	if (!CURCPU_EXISTS()) {
+		kmem_freeobj(kc, obj);
+		return;
+	}
+	kmem_cpu_reap(kc);
+
+	while (1) {
+		spill = NULL;
+		spl = splhigh();
+		KASSERT(curcpu->c_number < MAXCPUS);
+		kcc = &kc->kc_cpu[curcpu->c_number];
+		while (1) {
+			mag = kcc->kcc_loaded;
+			if (mag != NULL && mag->m_rounds < KMEM_MAGSIZE) {
+				mag->m_objs[mag->m_rounds++] = obj;
+				kcc->kcc_hits++;
+				splx(spl);
+				return;
+			}
+			if (kcc->kcc_prev != NULL &&
+			    kcc->kcc_prev->m_rounds < KMEM_MAGSIZE) {
+				kcc->kcc_loaded = kcc->kcc_prev;
+				kcc->kcc_prev = mag;
+				continue;
+			}
+
+			/* Both full; trade the previous one for an empty. */
+			kcc->kcc_misses++;
+			spinlock_acquire(&kc->kc_lock);
+			if (kcc->kcc_prev != NULL &&
+			    kc->kc_nfull >= KMEM_DEPOTMAX) {
+				/* The depot has plenty; empty prev instead. */
+				spinlock_release(&kc->kc_lock);
+				spill = kcc->kcc_prev;
+				kcc->kcc_prev = NULL;
+				break;
+			}
+			mag = kc->kc_empty;
+			if (mag == NULL) {
+				spinlock_release(&kc->kc_lock);
+				break;
+			}
+			kc->kc_empty = mag->m_next;
+			kc->kc_nempty--;
+			if (kcc->kcc_prev != NULL) {
+				kcc->kcc_prev->m_next = kc->kc_full;
+				kc->kc_full = kcc->kcc_prev;
+				kc->kc_nfull++;
+			}
+			spinlock_release(&kc->kc_lock);
+			kcc->kcc_prev = kcc->kcc_loaded;
+			kcc->kcc_loaded = mag;
+		}
+		splx(spl);
+
+		if (spill != NULL) {
+			/*
+			 * Free the objects of the magazine we took, and
+			 * put it in the depot as an empty one.
+			 */
+			n = spill->m_rounds;
+			for (i=0; i<n; i++) {
+				kmem_freeobj(kc, spill->m_objs[i]);
+			}
+			spill->m_rounds = 0;
+			spinlock_acquire(&kc->kc_lock);
+			kc->kc_reaped += n;
+			spill->m_next = kc->kc_empty;
+			kc->kc_empty = spill;
+			kc->kc_nempty++;
+			spinlock_release(&kc->kc_lock);
+			continue;
+		}
+
+		/*
+		 * The depot has no empty magazines. Make one and try
+		 * again; we may be on another cpu by then. If there is
+		 * no memory for it, the object goes back to kfree.
+		 */
+		mag = kmalloc(sizeof(*mag));
+		if (mag == NULL) {
+			kmem_freeobj(kc, obj);
+			return;
+		}
+		mag->m_rounds = 0;
+		spinlock_acquire(&kc->kc_lock);
+		mag->m_next = kc->kc_empty;
+		kc->kc_empty = mag;
+		kc->kc_nempty++;
+		spinlock_release(&kc->kc_lock);
+	}
+}
+
+/*
+ * Free the full and empty magazines in KC's depot, and their objects.
+ */
+static
+unsigned
+kmem_cache_reap(struct kmem_cache *kc)
+{
+	struct kmem_magazine *full, *empty, *mag;
+	unsigned n;
+
+	spinlock_acquire(&kc->kc_lock);
+	full = kc->kc_full;
+	empty = kc->kc_empty;
+	kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nfull = kc->kc_nempty = 0;
+	kc->kc_reapgen++;
+	spinlock_release(&kc->kc_lock);
+
+	n = 0;
+	while (full != NULL) {
+		mag = full;
+		full = mag->m_next;
+		n += kmem_freemag(kc, mag);
+	}
+	while (empty != NULL) {
+		mag = empty;
+		empty = mag->m_next;
+		kfree(mag);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_reaped += n;
+	spinlock_release(&kc->kc_lock);
+
+	/* Our own magazines we can do now; other cpus' come later. */
+	if (CURCPU_EXISTS()) {
+		n += kmem_cpu_reap(kc);
+	}
+	return n;
+}
+
+unsigned
+kmem_reap(void)
+{
+	struct kmem_cache *kc;
+	unsigned n;
+
+	/* Caches are never destroyed, so the list only grows at the head. */
+	spinlock_acquire(&kmem_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_lock);
+
+	n = 0;
+	for (; kc != NULL; kc = kc->kc_next) {
+		n += kmem_cache_reap(kc);
+	}
+	return n;
+}
+
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned i, hits, misses;
+
+	spinlock_acquire(&kmem_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_lock);
+
+	kprintf("Object caches:\n");
+	for (; kc != NULL; kc = kc->kc_next) {
+		hits = misses = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			hits += kc->kc_cpu[i].kcc_hits;
+			misses += kc->kc_cpu[i].kcc_misses;
+		}
+		kprintf("  %-12s %4lu bytes: %u hits, %u misses, "
+			"%u/%u full/empty magazines, %u allocated, "
+			"%u reaped\n",
+			kc->kc_name, (unsigned long)kc->kc_size, hits, misses,
+			kc->kc_nfull, kc->kc_nempty, kc->kc_allocs,
+			kc->kc_reaped);
+	}
+}
@@ -0,0 +1,305 @@
+/*
+ * Shared cache of executable and mapped file pages. See pagecache.h
+ * for the interface.
+ *
+ * Entries are hashed on vnode and offset, and also kept on a list in
+ * least recently used order for pagecache_reclaim.
+ *
+ * pagecache_update reads changed pages in again with the pages
+ * unlocked. The entries it is working on are pinned meanwhile, so
+ * that nothing frees them.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+#define PC_NBUCKETS  64
+#define PC_MAXPIN    16	/* entries pagecache_update reads at once */
+
+struct pcentry {
+	struct vnode *pc_vnode;
+	off_t pc_offset;		/* file offset of the page start */
+	unsigned pc_start, pc_end;	/* bytes from the file */
+	paddr_t pc_pa;
+	unsigned pc_pins;		/* pagecache_update is reading it */
+	unsigned pc_updategen;		/* last pagecache_update to look */
+	struct pcentry *pc_hashnext;
+	struct pcentry *pc_lruprev;	/* toward least recently used */
+	struct pcentry *pc_lrunext;	/* toward most recently used */
+};
+
+static struct pcentry *pc_hash[PC_NBUCKETS];
+static struct pcentry *pc_lruhead;	/* least recently used */
+static struct pcentry *pc_lrutail;	/* most recently used */
+
+static unsigned pc_npages;
+static unsigned pc_hits, pc_misses, pc_reclaims, pc_updates;
+static unsigned pc_updategen;
+
+static
+unsigned
+pc_bucket(struct vnode *v, off_t offset)
+{
+	return (((uintptr_t)v >> 4) ^ (unsigned)(offset / PAGE_SIZE))
+		% PC_NBUCKETS;
+}
+
+static
+void
+pc_lruremove(struct pcentry *pc)
+{
+	if (pc->pc_lruprev != NULL) {
+		pc->pc_lruprev->pc_lrunext = pc->pc_lrunext;
+	}
+	else {
+		pc_lruhead = pc->pc_lrunext;
+	}
+	if (pc->pc_lrunext != NULL) {
+		pc->pc_lrunext->pc_lruprev = pc->pc_lruprev;
+	}
+	else {
+		pc_lrutail = pc->pc_lruprev;
+	}
+}
+
+static
+void
+pc_lruappend(struct pcentry *pc)
+{
+	pc->pc_lruprev = pc_lrutail;
+	pc->pc_lrunext = NULL;
+	if (pc_lrutail != NULL) {
+		pc_lrutail->pc_lrunext = pc;
+	}
+	else {
+		pc_lruhead = pc;
+	}
+	pc_lrutail = pc;
+}
+
+/*
+ * Take PC out of the cache and free it, dropping the cache's frame
+ * and vnode references.
+ */
+static
+void
+pc_remove(struct pcentry *pc)
+{
+	struct pcentry **pp;
+
+	KASSERT(pc->pc_pins == 0);
+
+	for (pp = &pc_hash[pc_bucket(pc->pc_vnode, pc->pc_offset)];
+	     *pp != pc; pp = &(*pp)->pc_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = pc->pc_hashnext;
+	pc_lruremove(pc);
+
+	coremap_free(pc->pc_pa);
+	VOP_DECREF(pc->pc_vnode);
+	kfree(pc);
+	pc_npages--;
+}
+
+/*
+ * Whether PC holds any of the file bytes [START, END).
+ */
+static
+bool
+pc_overlaps(struct pcentry *pc, off_t start, off_t end)
+{
+	return pc->pc_offset + pc->pc_start < end &&
+		start < pc->pc_offset + pc->pc_end;
+}
+
+/*
+ * Read the file bytes [START, END) that PC holds into its frame
+ * again. Bytes that are no longer in the file read as zero. Call
+ * with PC pinned and the pages unlocked.
+ */
+static
+void
+pc_refresh(struct pcentry *pc, off_t start, off_t end)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *kva;
+	off_t s, e;
+	int result;
+
+	KASSERT(pc->pc_pins > 0);
+
+	s = pc->pc_offset + pc->pc_start;
+	if (s < start) {
+		s = start;
+	}
+	e = pc->pc_offset + pc->pc_end;
+	if (e > end) {
+		e = end;
+	}
+	kva = (char *)PADDR_TO_KVADDR(pc->pc_pa) + (s - pc->pc_offset);
+
+	uio_kinit(&iov, &ku, kva, e - s, s, UIO_READ);
+	result = VOP_READ(pc->pc_vnode, &ku);
+	if (result) {
+		kprintf("pagecache: rereading page: %s\n", strerror(result));
+		return;
+	}
+	bzero(kva + (e - s) - ku.uio_resid, ku.uio_resid);
+}
+
+paddr_t
+pagecache_lookup(struct vnode *v, off_t offset, unsigned start, unsigned end,
+		 struct addrspace *as, vaddr_t vaddr)
+{
+	struct pcentry *pc;
+
+	for (pc = pc_hash[pc_bucket(v, offset)]; pc != NULL;
+	     pc = pc->pc_hashnext) {
+		if (pc->pc_vnode == v && pc->pc_offset == offset &&
+		    pc->pc_start == start && pc->pc_end == end) {
+			pc_lruremove(pc);
+			pc_lruappend(pc);
+			coremap_share(pc->pc_pa, as, vaddr);
+			pc_hits++;
+			return pc->pc_pa;
+		}
+	}
+	pc_misses++;
+	return 0;
+}
+
+int
+pagecache_insert(struct vnode *v, off_t offset, unsigned start, unsigned end,
+		 paddr_t pa)
+{
+	struct pcentry *pc;
+	unsigned b;
+
+	pc = kmalloc(sizeof(struct pcentry));
+	if (pc == NULL) {
+		return ENOMEM;
+	}
+	VOP_INCREF(v);
+	pc->pc_vnode = v;
+	pc->pc_offset = offset;
+	pc->pc_start = start;
+	pc->pc_end = end;
+	pc->pc_pa = pa;
+	pc->pc_pins = 0;
+	pc->pc_updategen = 0;
+	coremap_pcshare(pa);
+
+	b = pc_bucket(v, offset);
+	pc->pc_hashnext = pc_hash[b];
+	pc_hash[b] = pc;
+	pc_lruappend(pc);
+	pc_npages++;
+	return 0;
+}
+
+unsigned
+pagecache_reclaim(unsigned n)
+{
+	struct pcentry *pc, *next;
+	unsigned freed;
+
+	freed = 0;
+	for (pc = pc_lruhead; pc != NULL && freed < n; pc = next) {
+		next = pc->pc_lrunext;
+		if (pc->pc_pins > 0 || coremap_refcount(pc->pc_pa) > 1) {
+			/* Still mapped somewhere, or being read. */
+			continue;
+		}
+		pc_remove(pc);
+		freed++;
+	}
+	pc_reclaims += freed;
+	return freed;
+}
+
+void
+pagecache_update(struct vnode *v, off_t start, off_t end)
+{
+	struct pcentry *pc, *next, *pinned[PC_MAXPIN];
+	unsigned i, n, gen;
+
+	if (start >= end) {
+		return;
+	}
+
+	vm_lockpages();
+	gen = ++pc_updategen;
+	do {
+		/*
+		 * Collect what needs reading, marking each entry with
+		 * this update's generation so that later rounds skip
+		 * it.
+		 */
+		n = 0;
+		for (pc = pc_lruhead; pc != NULL && n < PC_MAXPIN;
+		     pc = next) {
+			next = pc->pc_lrunext;
+			if (pc->pc_vnode != v || pc->pc_updategen == gen ||
+			    !pc_overlaps(pc, start, end)) {
+				continue;
+			}
+			pc->pc_updategen = gen;
+			pc_updates++;
+			if (pc->pc_pins == 0 &&
+			    coremap_refcount(pc->pc_pa) == 1) {
+				/* Nobody maps it; just forget it. */
+				pc_remove(pc);
+				continue;
+			}
+			pc->pc_pins++;
+			pinned[n++] = pc;
+		}
+		if (n == 0) {
+			break;
+		}
+
+		vm_unlockpages();
+		for (i=0; i<n; i++) {
+			pc_refresh(pinned[i], start, end);
+		}
+		vm_lockpages();
+
+		for (i=0; i<n; i++) {
+			pinned[i]->pc_pins--;
+		}
+	} while (n == PC_MAXPIN);
+	vm_unlockpages();
+}
+
+void
+pagecache_invalidate(struct vnode *v)
+{
+	struct pcentry *pc, *next;
+
+	vm_lockpages();
+	for (pc = pc_lruhead; pc != NULL; pc = next) {
+		next = pc->pc_lrunext;
+		if (pc->pc_vnode == v && pc->pc_pins == 0 &&
+		    coremap_refcount(pc->pc_pa) == 1) {
+			pc_remove(pc);
+			pc_updates++;
+		}
+	}
+	vm_unlockpages();
+}
+
+void
+pagecache_printstats(void)
+{
+	kprintf("Page cache: %u pages, %u hits, %u misses, %u reclaimed, "
+		"%u changed under it\n", pc_npages, pc_hits, pc_misses,
+		pc_reclaims, pc_updates);
+}
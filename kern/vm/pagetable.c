@@ -0,0 +1,61 @@
+/*
+ * Two-level page table. See pagetable.h for details.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct pagetable {
+	uint32_t *pt_dir[PT_NENTRIES];
+};
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_NENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_NENTRIES; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+uint32_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	uint32_t *leaf;
+
+	leaf = pt->pt_dir[PT_L1INDEX(vaddr)];
+	if (leaf == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		leaf = kmalloc(PT_NENTRIES * sizeof(uint32_t));
+		if (leaf == NULL) {
+			return NULL;
+		}
+		bzero(leaf, PT_NENTRIES * sizeof(uint32_t));
+		pt->pt_dir[PT_L1INDEX(vaddr)] = leaf;
+	}
+	return &leaf[PT_L2INDEX(vaddr)];
+}
@@ -0,0 +1,211 @@
+/*
+ * Swap space. See swap.h for the interface; the pageout policy is in
+ * vm.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+static struct vnode *swap_vnode;	/* NULL if there is no swap */
+static struct bitmap *swap_map;		/* slots in use */
+static uint16_t *swap_refs;		/* PTEs naming each slot */
+static unsigned swap_nslots;
+static unsigned swap_nused;
+static unsigned swap_hint;		/* where the next search starts */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;	/* vfs_open may scribble on it */
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; paging disabled\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result == 0 && st.st_size / PAGE_SIZE > 0) {
+		swap_nslots = st.st_size / PAGE_SIZE;
+		swap_map = bitmap_create(swap_nslots);
+		swap_refs = kmalloc(swap_nslots * sizeof(uint16_t));
+	}
+	if (swap_map == NULL || swap_refs == NULL) {
+		kprintf("swap: %s: cannot set up; paging disabled\n",
+			SWAP_DEVICE);
+		if (swap_map != NULL) {
+			bitmap_destroy(swap_map);
+			swap_map = NULL;
+		}
+		kfree(swap_refs);
+		swap_refs = NULL;
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		swap_nslots = 0;
+		return;
+	}
+
+	kprintf("swap: %s, %u pages\n", SWAP_DEVICE, swap_nslots);
+}
+
+unsigned
+swap_alloc(unsigned nslots, unsigned *slot)
+{
+	unsigned start, i, n;
+
+	KASSERT(nslots > 0);
+
+	if (swap_vnode == NULL) {
+		return 0;
+	}
+
+	spinlock_acquire(&swap_lock);
+
+	/* First free slot at or after the hint, wrapping around. */
+	start = swap_hint;
+	for (i=0; i<swap_nslots; i++) {
+		if (!bitmap_isset(swap_map, start)) {
+			break;
+		}
+		start = (start + 1) % swap_nslots;
+	}
+	if (i == swap_nslots) {
+		spinlock_release(&swap_lock);
+		return 0;
+	}
+
+	/* Take as many following free slots as are wanted. */
+	n = 0;
+	while (n < nslots && start + n < swap_nslots &&
+	       !bitmap_isset(swap_map, start + n)) {
+		bitmap_mark(swap_map, start + n);
+		swap_refs[start + n] = 1;
+		n++;
+	}
+	swap_nused += n;
+	swap_hint = (start + n) % swap_nslots;
+
+	spinlock_release(&swap_lock);
+
+	*slot = start;
+	return n;
+}
+
+void
+swap_share(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	KASSERT(swap_refs[slot] > 0);
+	if (swap_refs[slot] == 0xffff) {
+		panic("swap: too many sharers of slot %u\n", slot);
+	}
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	spinlock_release(&swap_lock);
+}
+
+int
+swap_in(unsigned slot, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, UIO_READ);
+	result = VOP_READ(swap_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return 0;
+}
+
+int
+swap_out(unsigned slot, const paddr_t *pas, unsigned npages)
+{
+	struct iovec iov[SWAP_MAXCLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(npages > 0 && npages <= SWAP_MAXCLUSTER);
+	KASSERT(slot + npages <= swap_nslots);
+
+	/* One write for the whole cluster. */
+	for (i=0; i<npages; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = npages;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = npages * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+
+	result = VOP_WRITE(swap_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+
+	for (i=0; i<npages; i++) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	return 0;
+}
+
+void
+swap_printstats(void)
+{
+	if (swap_vnode == NULL) {
+		kprintf("Swap: none\n");
+		return;
+	}
+	kprintf("Swap: %s, %u pages, %u in use\n", SWAP_DEVICE,
+		swap_nslots, swap_nused);
+}
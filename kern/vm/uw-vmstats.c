@@ -14,6 +14,7 @@
 #include <lib.h>
 #include <synch.h>
 #include <spl.h>
+#include <vm.h>
 #include <uw-vmstats.h>
 
 /* Counters for tracking statistics */
@@ -33,6 +34,18 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "TLB Flushes Avoided (ASID)",
+ /* 11 */ "Page Faults (Compressed)",
+ /* 12 */ "Compressed Pages Stored",
+ /* 13 */ "Compressed Bytes Stored",
+ /* 14 */ "Pages Too Big to Compress",
+ /* 15 */ "Compressed Pages Spilled",
+ /* 16 */ "Page Faults (Shared Text)",
+ /* 17 */ "Pages Prefetched",
+ /* 18 */ "Prefetched Pages Used",
+ /* 19 */ "TLB Shootdown IPIs",
+ /* 20 */ "TLB Shootdown IPIs Skipped",
+ /* 21 */ "Page Faults from Mapped File",
 };
 
 
@@ -46,6 +59,16 @@ vmstats_inc(unsigned int index)
     spinlock_release(&stats_lock);
 }
 
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+void
+vmstats_add(unsigned int index, unsigned int n)
+{
+    spinlock_acquire(&stats_lock);
+      _vmstats_add(index, n);
+    spinlock_release(&stats_lock);
+}
+
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
@@ -68,6 +91,14 @@ _vmstats_inc(unsigned int index)
   stats_counts[index]++;
 }
 
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_add(unsigned int index, unsigned int n)
+{
+  KASSERT(index < VMSTAT_COUNT);
+  stats_counts[index] += n;
+}
+
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
@@ -102,6 +133,11 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  unsigned int zstored = 0;
+  unsigned int zbytes = 0;
+  unsigned int zhits = 0;
+  unsigned int swapins = 0;
+  unsigned int prefetched = 0;
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
@@ -109,10 +145,13 @@ vmstats_print(void)
   }
 
   tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
+  prefetched = stats_counts[VMSTAT_PREFETCH];
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
-    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
+    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD] +
+    stats_counts[VMSTAT_PAGE_FAULT_ZSWAP] + stats_counts[VMSTAT_PAGE_FAULT_CACHED];
+  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_MAPPED_FILE_READ] +
+    stats_counts[VMSTAT_SWAP_FILE_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
@@ -121,17 +160,41 @@ vmstats_print(void)
       tlb_faults, free_plus_replace); 
   }
 
-  kprintf("VMSTAT TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) = %d\n",
+  /* Prefetched pages are paged in without a fault of their own. */
+  kprintf("VMSTAT TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) + Page Faults (Compressed) + Page Faults (Shared Text) = %d\n",
     disk_plus_zeroed_plus_reload);
-  if (tlb_faults != disk_plus_zeroed_plus_reload) {
-    kprintf("WARNING: TLB Faults (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) (%d)\n",
-      tlb_faults, disk_plus_zeroed_plus_reload); 
+  if (tlb_faults + (int)prefetched != disk_plus_zeroed_plus_reload) {
+    kprintf("WARNING: TLB Faults (%d) + Pages Prefetched (%u) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) + Page Faults (Compressed) + Page Faults (Shared Text) (%d)\n",
+      tlb_faults, prefetched, disk_plus_zeroed_plus_reload); 
   }
 
-  kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
+  kprintf("VMSTAT ELF File reads + Mapped File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
   if (disk_reads != elf_plus_swap_reads) {
-    kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
+    kprintf("WARNING: ELF File reads + Mapped File reads + Swapfile reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+  /* Compressed swap: how well pages compress, and how many of the
+   * pages brought back from swap came from memory rather than disk.
+   */
+  zstored = stats_counts[VMSTAT_ZSWAP_STORE];
+  zbytes = stats_counts[VMSTAT_ZSWAP_BYTES];
+  if (zbytes > 0) {
+    kprintf("VMSTAT Compression ratio = %u.%02u\n",
+      zstored * PAGE_SIZE / zbytes,
+      (zstored * PAGE_SIZE % zbytes) * 100 / zbytes);
+  }
+  zhits = stats_counts[VMSTAT_PAGE_FAULT_ZSWAP];
+  swapins = zhits + stats_counts[VMSTAT_SWAP_FILE_READ];
+  if (swapins > 0) {
+    kprintf("VMSTAT Compressed swap hit rate = %u%%\n",
+      zhits * 100 / swapins);
+  }
+
+  /* Fault-around: how much of what was prefetched got used. */
+  if (prefetched > 0) {
+    kprintf("VMSTAT Prefetch hit rate = %u%%\n",
+      stats_counts[VMSTAT_PREFETCH_USED] * 100 / prefetched);
+  }
 }
 /* ---------------------------------------------------------------------- */
@@ -0,0 +1,1373 @@
+/*
+ * Paged virtual memory: fault handling and TLB management. Address
+ * space bookkeeping is in addrspace.c, the page table in pagetable.c
+ * and physical memory in coremap.c.
+ *
+ * A user page gets a frame the first time it faults. If the region it
+ * is in is backed by the executable, the page is read in from there;
+ * anything not covered by the file is zero-filled. Pages with nothing
+ * from the file at all take frames the idle loop has already zeroed
+ * (coremap_allocz), when there are any. Pages of read-only regions
+ * are shared through the page cache (pagecache.c) instead: the first
+ * process to fault one in reads it, and everybody running the same
+ * executable afterwards maps the same frame. vm_premap maps whatever
+ * is cached already when a program is loaded.
+ *
+ * mmap regions (as_map) work the same way with the mapped file in
+ * place of the executable, so a mapped page is the cached frame
+ * itself, with no copy. MAP_PRIVATE pages are copied on first write
+ * like the pages as_copy shares; MAP_SHARED ones are written in place
+ * and written back to the file by as_unmap or when the process exits.
+ *
+ * A region being swept through a page at a time has the next few
+ * pages paged in ahead of the sweep (vm_faultaround), in a window that
+ * grows while the sweep continues. madvise (as_advise) can turn that
+ * off, make it more aggressive, or prefetch or drop a range at once.
+ *
+ * Misses on pages that are already resident normally never get this
+ * far: the UTLB handler in exception-mips1.S walks the page table and
+ * refills the TLB itself, into a random slot, without building a
+ * trapframe. vm_fault sees first touches, permission faults, entries
+ * demoted by NRU and pages demoted by the pageout clock. Fast-path
+ * refills don't show up in vmstats.
+ *
+ * as_copy shares resident pages between parent and child instead of
+ * copying them: both PTEs lose PTE_WRITE and the frame's coremap
+ * reference count goes up. A write to a page without PTE_WRITE in a
+ * writeable region gets the writer a private copy if the frame is
+ * still shared, and otherwise just write access. Every page starts
+ * out without PTE_WRITE, so this is also where pages get marked dirty
+ * (see pagetable.h).
+ *
+ * When every TLB slot is in use, a victim is chosen by the current
+ * replacement policy (vm_settlbpolicy):
+ *
+ *    TLBPOLICY_RR     - cycle through the slots in order.
+ *    TLBPOLICY_RANDOM - let the hardware pick (tlb_random).
+ *    TLBPOLICY_NRU    - second-chance clock. MIPS has no referenced
+ *                       bit, so each cpu keeps one per slot in
+ *                       software, set when the slot is filled or
+ *                       touched. The clock hand skips referenced
+ *                       slots, clearing the bit and the entry's
+ *                       hardware valid bit as it goes; touching a
+ *                       demoted entry faults and sets the bit again
+ *                       without going through replacement.
+ *
+ * When a user page is needed and memory is full, vm_pageout evicts
+ * a cluster of up to VM_PAGEOUT_CLUSTER pages. Victims are chosen by
+ * a second-chance clock over the pageable frames (coremap_clock):
+ * those only one address space maps, whether or not they are also in
+ * the page cache. Evicting a cached page just unmaps it, leaving the
+ * cache to let go of the frame later (pagecache_reclaim); only a
+ * MAP_SHARED page that has been written to must stay until it has
+ * been written back.
+ * The referenced bit is PTE_VALID itself: the clock hand clears it,
+ * so the next TLB miss on the page comes to vm_fault, which sets it
+ * again; a page still demoted when the hand comes round is evicted.
+ * Accesses through a TLB entry loaded before the demotion go
+ * unnoticed; with only NUM_TLB entries, such a page is usually
+ * reloaded, and so noticed, before the hand comes round again.
+ * Clean victims (never written since they were loaded) are just
+ * dropped and will be loaded again. Dirty ones go to the compressed
+ * pool (zswap.c) if they compress well and to the swap device if not,
+ * with one I/O per run of contiguous swap slots.
+ *
+ * Everything that changes a page table or a frame's sharing does so
+ * holding vm_pagelock: faults, pageout (including the clock's
+ * demotions), as_copy and as_destroy. A global lock is coarse, but
+ * it makes it safe for pageout to edit another process's page table.
+ * It is not held across disk I/O, though: a page being read in or
+ * written to swap is marked PTE_BUSY and the lock is dropped for the
+ * transfer. Anybody else who comes across the page meanwhile waits
+ * for it (vm_pagewait), or in the clock's case passes it by.
+ *
+ * The refill handler reads page tables without the lock; evicted
+ * PTEs are made invalid before any TLB entries for them are shot
+ * down on every cpu, so it cannot reload a page on its way out.
+ * vm_fault reloads pages whose PTEs are still valid (ones whose TLB
+ * entries NRU demoted, say) the same way, with interrupts off so that
+ * a shootdown can't get in between reading the PTE and loading it.
+ *
+ * TLB entries are tagged with the address space ID (ASID) of the
+ * address space they belong to, so switching between processes only
+ * changes the processor's current ASID rather than flushing the TLB.
+ * There are only NUM_TLBPID ASIDs, so they are handed out in
+ * generations: when they run out, the generation number goes up and
+ * every address space gets a fresh ASID the next time it is
+ * activated. Each cpu flushes its whole TLB the first time it
+ * activates anything in a new generation, which clears out entries
+ * tagged with ASIDs from the old one. ASID 0 is never handed out.
+ *
+ * Each address space records in as_cpus the cpus that have activated
+ * it under its current ASID, and so may still have entries for it.
+ * Shootdowns go only to those cpus, all of a cpu's entries in one
+ * IPI. Getting a new ASID starts the set over, since entries with
+ * the old one can no longer match; that makes vm_tlbinvalidate (used
+ * by munmap and fork) free of IPIs altogether.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <cpu.h>
+#include <thread.h>
+#include <vnode.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <zswap.h>
+#include <pagecache.h>
+#include <uw-vmstats.h>
+#include <platform/maxcpus.h>
+
+/* Most pages vm_pageout evicts at once. */
+#define VM_PAGEOUT_CLUSTER  8
+
+/*
+ * Fault-around window, in pages: where it starts and how far it grows,
+ * normally and in MADV_SEQUENTIAL regions. Sequential regions also
+ * drop the page VM_FAULTAROUND_SEQMAX behind each fault.
+ */
+#define VM_FAULTAROUND_MIN     2
+#define VM_FAULTAROUND_MAX     16
+#define VM_FAULTAROUND_SEQMAX  32
+
+#if VM_PAGEOUT_CLUSTER > SWAP_MAXCLUSTER
+#error "VM_PAGEOUT_CLUSTER is bigger than swap_out can write"
+#endif
+
+/* Per-cpu TLB state. */
+struct tlbstate {
+	unsigned ts_hand;		/* next slot for RR and NRU */
+	uint8_t ts_ref[NUM_TLB];	/* software referenced bits (NRU) */
+	uint32_t ts_asidgen;		/* ASID generation of TLB contents */
+};
+
+static struct tlbstate tlbstate[MAXCPUS];
+
+/*
+ * Page table of the address space active on each cpu, or NULL. Read
+ * by the UTLB refill handler in exception-mips1.S.
+ */
+struct pagetable *vm_cpupt[MAXCPUS];
+
+/*
+ * Refills the UTLB handler has done on each cpu without coming into
+ * vm_fault, since vm_tlbrefills last collected them. Bumped in
+ * exception-mips1.S.
+ */
+unsigned vm_cpurefills[MAXCPUS];
+static int vm_tlbpolicy = TLBPOLICY_RR;
+
+/* Serializes page table and frame changes with pageout; see above. */
+static struct semaphore *vm_pagelock;
+
+/* Where threads wait for PTE_BUSY pages. */
+static struct wchan *vm_pagewchan;
+
+/* ASID allocation. Generation 0 means "no ASID assigned". */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static unsigned asid_next = 1;
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	vmstats_init();
+
+	/* as_cpus has one bit per cpu. */
+	KASSERT(MAXCPUS <= 32);
+
+	vm_pagelock = sem_create("vm_pagelock", 1);
+	vm_pagewchan = wchan_create("vm_pagewchan");
+	if (vm_pagelock == NULL || vm_pagewchan == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+	swap_bootstrap();
+	zswap_bootstrap();
+}
+
+void
+vm_lockpages(void)
+{
+	P(vm_pagelock);
+}
+
+void
+vm_unlockpages(void)
+{
+	V(vm_pagelock);
+}
+
+/*
+ * Sleep until some PTE_BUSY page's I/O is done. The pages are
+ * unlocked in between, so anything looked at before needs looking at
+ * again; callers loop until their page isn't busy.
+ */
+void
+vm_pagewait(void)
+{
+	/* Lock the wchan first so vm_pageunbusy can't wake us too soon. */
+	wchan_lock(vm_pagewchan);
+	V(vm_pagelock);
+	wchan_sleep(vm_pagewchan);
+	P(vm_pagelock);
+}
+
+/*
+ * Mark the page at PTE no longer busy, and wake up anybody waiting.
+ * Call with the pages locked.
+ */
+void
+vm_pageunbusy(uint32_t *pte)
+{
+	KASSERT(*pte & PTE_BUSY);
+	*pte &= ~PTE_BUSY;
+	wchan_wakeall(vm_pagewchan);
+}
+
+/*
+ * Invalidate this cpu's whole TLB. Call at splhigh.
+ */
+static
+void
+vm_tlbflush(void)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	int spl;
+
+	spl = splhigh();
+	vm_tlbflush();
+	splx(spl);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	uint32_t ehi;
+	int i, spl;
+
+	ehi = (ts->ts_vaddr & TLBHI_VPAGE) |
+		(ts->ts_addrspace->as_asid << TLBHI_PIDSHIFT);
+
+	spl = splhigh();
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Carry out the shootdowns TS[0..N) on every cpu that may have the
+ * entries, and wait until all of them have. Each cpu gets one IPI
+ * for all of its entries, or a full flush if there are more than
+ * TLBSHOOTDOWN_MAX. Call with interrupts enabled.
+ *
+ * as_cpus is read without asid_lock. A cpu that joins it after we
+ * look can only load the PTEs as they are now; one that drops out
+ * has entries under an ASID that nothing matches any more.
+ */
+static
+void
+vm_tlbshootdown_sync(const struct tlbshootdown *ts, unsigned n)
+{
+	struct tlbshootdown batch[TLBSHOOTDOWN_MAX];
+	struct cpu *self, *c;
+	uint32_t bit, sent;
+	unsigned i, j, nbatch, ncpus;
+	int spl;
+
+	ncpus = cpu_numcpus();
+	sent = 0;
+
+	/* Stay on this cpu until the local part is done. */
+	spl = splhigh();
+	self = curcpu->c_self;
+	for (i=0; i<ncpus; i++) {
+		c = cpu_getcpu(i);
+		if (c == self) {
+			continue;
+		}
+		bit = (uint32_t)1 << c->c_number;
+		nbatch = 0;
+		for (j=0; j<n; j++) {
+			if ((ts[j].ts_addrspace->as_cpus & bit) == 0) {
+				continue;
+			}
+			if (nbatch < TLBSHOOTDOWN_MAX) {
+				batch[nbatch] = ts[j];
+			}
+			nbatch++;
+		}
+		if (nbatch == 0) {
+			vmstats_inc(VMSTAT_SHOOTDOWN_SKIPPED);
+			continue;
+		}
+		ipi_tlbshootdown_batch(c, batch, nbatch);
+		vmstats_inc(VMSTAT_SHOOTDOWN_IPI);
+		sent |= bit;
+	}
+	for (j=0; j<n; j++) {
+		vm_tlbshootdown(&ts[j]);
+	}
+	splx(spl);
+
+	for (i=0; i<ncpus; i++) {
+		c = cpu_getcpu(i);
+		if (sent & ((uint32_t)1 << c->c_number)) {
+			ipi_tlbshootdown_wait(c);
+		}
+	}
+}
+
+unsigned
+vm_tlbrefills(void)
+{
+	unsigned n;
+	int spl;
+
+	spl = splhigh();
+	n = vm_cpurefills[curcpu->c_number];
+	vm_cpurefills[curcpu->c_number] = 0;
+	splx(spl);
+	return n;
+}
+
+void
+vm_tlbactivate(struct addrspace *as)
+{
+	struct tlbstate *ts;
+	uint32_t gen;
+	int spl;
+
+	spl = splhigh();
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_TLBPID) {
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+		as->as_cpus = 0;
+	}
+	KASSERT(curcpu->c_number < MAXCPUS);
+	as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+	gen = asid_generation;
+	spinlock_release(&asid_lock);
+
+	ts = &tlbstate[curcpu->c_number];
+	if (ts->ts_asidgen != gen) {
+		vm_tlbflush();
+		ts->ts_asidgen = gen;
+	}
+	else {
+		/* Without ASIDs this switch would have cost a flush. */
+		vmstats_inc(VMSTAT_TLB_FLUSH_AVOIDED);
+	}
+	tlb_setpid(as->as_asid);
+	vm_cpupt[curcpu->c_number] = as->as_pt;
+
+	splx(spl);
+}
+
+void
+vm_tlbinvalidate(struct addrspace *as)
+{
+	/*
+	 * Entries tagged with the old ASID become unreachable once AS
+	 * has a new one, and the old ASID is not handed out again
+	 * until the next generation, when every TLB gets flushed.
+	 */
+	spinlock_acquire(&asid_lock);
+	as->as_asidgen = 0;
+	spinlock_release(&asid_lock);
+
+	if (as == curproc_getas()) {
+		vm_tlbactivate(as);
+	}
+}
+
+void
+vm_tlbdeactivate(struct addrspace *as)
+{
+	unsigned i;
+
+	/*
+	 * AS may have last been active on any cpu, not just this one.
+	 * It can't be running anywhere now, so no cpu can be using its
+	 * entry in vm_cpupt.
+	 */
+	for (i=0; i<MAXCPUS; i++) {
+		if (vm_cpupt[i] == as->as_pt) {
+			vm_cpupt[i] = NULL;
+		}
+	}
+}
+
+int
+vm_gettlbpolicy(void)
+{
+	return vm_tlbpolicy;
+}
+
+void
+vm_settlbpolicy(int policy)
+{
+	KASSERT(policy == TLBPOLICY_RR || policy == TLBPOLICY_RANDOM ||
+		policy == TLBPOLICY_NRU);
+	vm_tlbpolicy = policy;
+}
+
+/*
+ * Pick a slot to evict under the NRU policy, demoting referenced
+ * slots that the clock hand passes over. Always terminates: after
+ * at most one full sweep every bit is clear.
+ */
+static
+unsigned
+vm_tlbnru(struct tlbstate *ts)
+{
+	uint32_t ehi, elo;
+	unsigned i;
+
+	while (1) {
+		i = ts->ts_hand;
+		ts->ts_hand = (ts->ts_hand + 1) % NUM_TLB;
+		if (!ts->ts_ref[i]) {
+			return i;
+		}
+		ts->ts_ref[i] = 0;
+		tlb_read(&ehi, &elo, i);
+		tlb_write(ehi, elo & ~TLBLO_VALID, i);
+	}
+}
+
+/*
+ * Load EHI/ELO into this cpu's TLB. Call at splhigh.
+ */
+static
+void
+vm_tlbinsert(uint32_t ehi, uint32_t elo)
+{
+	struct tlbstate *ts;
+	uint32_t oldhi, oldlo;
+	int i;
+
+	KASSERT(curcpu->c_number < MAXCPUS);
+	ts = &tlbstate[curcpu->c_number];
+
+	/*
+	 * The page may still be in the TLB with its valid bit clear
+	 * (demoted by NRU). Reuse that slot; the TLB must never hold
+	 * two entries for the same page. This counts as a fault with
+	 * a free slot, since nothing valid is displaced.
+	 */
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		ts->ts_ref[i] = 1;
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		return;
+	}
+
+	/*
+	 * Look for a slot without a valid entry. Demoted NRU entries
+	 * count: nothing is lost by reusing them.
+	 */
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&oldhi, &oldlo, i);
+		if (oldlo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		ts->ts_ref[i] = 1;
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		return;
+	}
+
+	switch (vm_tlbpolicy) {
+	    case TLBPOLICY_RANDOM:
+		tlb_random(ehi, elo);
+		break;
+	    case TLBPOLICY_NRU:
+		i = vm_tlbnru(ts);
+		tlb_write(ehi, elo, i);
+		ts->ts_ref[i] = 1;
+		break;
+	    default:
+		i = ts->ts_hand;
+		ts->ts_hand = (ts->ts_hand + 1) % NUM_TLB;
+		tlb_write(ehi, elo, i);
+		break;
+	}
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+}
+
+/*
+ * Update the TLB entry EHI after a permission change, or load it if
+ * it isn't there any more. Call at splhigh.
+ */
+static
+void
+vm_tlbupdate(uint32_t ehi, uint32_t elo)
+{
+	int i;
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+}
+
+
+////////////////////////////////////////////////////////////
+//
+// Pageout
+
+/* Victims collected by the clock for one vm_pageout. */
+struct pageout {
+	unsigned po_n;
+	struct tlbshootdown po_ts[VM_PAGEOUT_CLUSTER];
+	uint32_t *po_pte[VM_PAGEOUT_CLUSTER];
+	paddr_t po_pa[VM_PAGEOUT_CLUSTER];
+};
+
+/*
+ * Clock visitor for vm_pageout: give referenced pages a second chance
+ * and collect the rest, marked busy: storing them in the compressed
+ * pool or in swap may unlock the pages. Runs with the coremap locked.
+ */
+static
+bool
+vm_pageout_visit(struct addrspace *as, vaddr_t vaddr, paddr_t pa, bool pcache,
+		 void *data)
+{
+	struct pageout *po = data;
+	uint32_t *pte;
+	unsigned i;
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL || !(*pte & PTE_INCORE) || (*pte & PTE_FRAME) != pa) {
+		/* Just allocated; our caller hasn't mapped it yet. */
+		return false;
+	}
+	if (*pte & PTE_BUSY) {
+		/* On its way out already, or in use by vm_writefault. */
+		return false;
+	}
+	if (pcache && (*pte & PTE_DIRTY)) {
+		/* Written through MAP_SHARED; see vm_writeback. */
+		return false;
+	}
+	if (*pte & PTE_VALID) {
+		*pte &= ~PTE_VALID;
+		return false;
+	}
+
+	*pte |= PTE_BUSY;
+	i = po->po_n++;
+	po->po_ts[i].ts_addrspace = as;
+	po->po_ts[i].ts_vaddr = vaddr;
+	po->po_pte[i] = pte;
+	po->po_pa[i] = pa;
+	return po->po_n == VM_PAGEOUT_CLUSTER;
+}
+
+/*
+ * Evict up to VM_PAGEOUT_CLUSTER user pages. Returns ENOMEM if none
+ * could be freed. Call with vm_pagelock held; it is dropped while
+ * pages are written to swap, the victims' or ones zswap spills.
+ */
+static
+int
+vm_pageout(void)
+{
+	struct pageout po;
+	paddr_t dirty[VM_PAGEOUT_CLUSTER];
+	unsigned dirtyvictim[VM_PAGEOUT_CLUSTER];
+	unsigned dirtyslot[VM_PAGEOUT_CLUSTER];
+	unsigned i, j, n, v, ndirty, nwritten, nfreed, slot, handle;
+	int result;
+
+	/*
+	 * Kernel memory the heap is only holding for reuse (idle thread
+	 * stacks and the like), and cached text that nobody is running,
+	 * are the cheapest to give up.
+	 */
+	if (kheap_trim() || pagecache_reclaim(VM_PAGEOUT_CLUSTER) > 0) {
+		return 0;
+	}
+
+	po.po_n = 0;
+	coremap_clock(vm_pageout_visit, &po);
+	if (po.po_n == 0) {
+		return ENOMEM;
+	}
+
+	/*
+	 * The victims' PTEs are already invalid, so nothing can load
+	 * them into a TLB again. Get rid of the entries that are there
+	 * before looking at what is in the pages: until then, a process
+	 * on another cpu could still be writing to them.
+	 */
+	vm_tlbshootdown_sync(po.po_ts, po.po_n);
+
+	nfreed = ndirty = 0;
+	for (i=0; i<po.po_n; i++) {
+		if (!(*po.po_pte[i] & PTE_DIRTY)) {
+			/* Unchanged since it was loaded; just load it again. */
+			vm_pageunbusy(po.po_pte[i]);
+			*po.po_pte[i] = 0;
+		}
+		else if (zswap_store(po.po_pa[i], po.po_ts[i].ts_addrspace,
+				     po.po_ts[i].ts_vaddr, &handle) == 0) {
+			vm_pageunbusy(po.po_pte[i]);
+			*po.po_pte[i] = PTE_MKZSLOT(handle);
+		}
+		else {
+			dirty[ndirty] = po.po_pa[i];
+			dirtyvictim[ndirty] = i;
+			ndirty++;
+			continue;
+		}
+		coremap_unshare(po.po_pa[i], po.po_ts[i].ts_addrspace,
+				po.po_ts[i].ts_vaddr);
+		nfreed++;
+	}
+
+	if (ndirty == 0) {
+		goto done;
+	}
+
+	/*
+	 * Write the dirty ones in as few runs of contiguous slots as we
+	 * can get. They are busy, so the pages can be unlocked for the
+	 * writes. If swap is full (or missing), or a write fails, the
+	 * rest stay resident.
+	 */
+	nwritten = 0;
+	vm_unlockpages();
+	for (i=0; i<ndirty; i+=n) {
+		n = swap_alloc(ndirty - i, &slot);
+		if (n == 0) {
+			break;
+		}
+		result = swap_out(slot, &dirty[i], n);
+		if (result) {
+			kprintf("vm: swap write failed: %s\n",
+				strerror(result));
+			for (j=0; j<n; j++) {
+				swap_free(slot + j);
+			}
+			break;
+		}
+		for (j=0; j<n; j++) {
+			dirtyslot[i + j] = slot + j;
+		}
+		nwritten = i + n;
+	}
+	vm_lockpages();
+
+	for (i=0; i<ndirty; i++) {
+		v = dirtyvictim[i];
+		vm_pageunbusy(po.po_pte[v]);
+		if (i >= nwritten) {
+			continue;
+		}
+		*po.po_pte[v] = PTE_MKSLOT(dirtyslot[i]);
+		coremap_unshare(po.po_pa[v], po.po_ts[v].ts_addrspace,
+				po.po_ts[v].ts_vaddr);
+		nfreed++;
+	}
+
+ done:
+	DEBUG(DB_VM, "vm: pageout: %u of %u victims freed\n", nfreed, po.po_n);
+	return nfreed > 0 ? 0 : ENOMEM;
+}
+
+paddr_t
+vm_allocframe(struct addrspace *as, vaddr_t vaddr, bool zero)
+{
+	paddr_t pa;
+
+	while ((pa = zero ? coremap_allocz() : coremap_alloc(1, false)) == 0) {
+		if (vm_pageout()) {
+			return 0;
+		}
+	}
+	coremap_setowner(pa, as, vaddr);
+	return pa;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Faults
+
+/*
+ * Handle a write to a resident page mapped without PTE_WRITE in a
+ * writeable region RG. That is either the first write since the page
+ * was loaded, or a write to a page shared copy-on-write; in the
+ * latter case, copy it first if the frame is still shared. Pages of
+ * MAP_SHARED regions are written in place even when shared: that is
+ * the point of them.
+ */
+static
+int
+vm_writefault(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	      uint32_t *pte)
+{
+	struct tlbshootdown ts;
+	paddr_t oldpa, newpa;
+
+	KASSERT(*pte & PTE_INCORE);
+	KASSERT(!(*pte & PTE_WRITE));
+
+	oldpa = *pte & PTE_FRAME;
+	if ((rg->rg_flags & RG_SHARED) && coremap_refcount(oldpa) > 1) {
+		/* Not paged out while dirty; see vm_writeback. */
+		*pte |= PTE_WRITE | PTE_DIRTY;
+		return 0;
+	}
+	if (coremap_refcount(oldpa) == 1) {
+		/* Never shared, or the other sharers have gone away. */
+		*pte |= PTE_WRITE | PTE_DIRTY;
+		return 0;
+	}
+
+	/* Making room may unlock the pages; keep pageout off this one. */
+	*pte |= PTE_BUSY;
+	newpa = vm_allocframe(as, vaddr, false);
+	vm_pageunbusy(pte);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | (*pte & ~PTE_FRAME) | PTE_WRITE | PTE_DIRTY;
+
+	/*
+	 * Cpus this process ran on before may still have read-only
+	 * entries for the old frame. (This cpu's gets replaced when
+	 * the fault finishes.)
+	 */
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	vm_tlbshootdown_sync(&ts, 1);
+
+	coremap_unshare(oldpa, as, vaddr);
+	return 0;
+}
+
+/*
+ * Find the bytes of the page at VADDR that come from the executable
+ * according to SB, as offsets [*START, *END) into the page. Returns
+ * false if there are none.
+ */
+static
+bool
+vm_filerange(const struct segbacking *sb, vaddr_t vaddr,
+	     unsigned *start, unsigned *end)
+{
+	vaddr_t s, e;
+
+	s = vaddr;
+	if (s < sb->sb_vaddr) {
+		s = sb->sb_vaddr;
+	}
+	e = vaddr + PAGE_SIZE;
+	if (e > sb->sb_vaddr + sb->sb_filesz) {
+		e = sb->sb_vaddr + sb->sb_filesz;
+	}
+	if (sb->sb_filesz == 0 || s >= e) {
+		return false;
+	}
+	*start = s - vaddr;
+	*end = e - vaddr;
+	return true;
+}
+
+/*
+ * File offset of the start of the page at VADDR. May be negative if
+ * the segment starts partway into its first page.
+ */
+static
+off_t
+vm_fileoffset(const struct segbacking *sb, vaddr_t vaddr)
+{
+	return sb->sb_offset + ((off_t)vaddr - (off_t)sb->sb_vaddr);
+}
+
+/*
+ * The file backing region RG: the one it maps, or the executable.
+ */
+static
+struct vnode *
+vm_backingvnode(struct addrspace *as, struct region *rg)
+{
+	return rg->rg_vnode != NULL ? rg->rg_vnode : as->as_vnode;
+}
+
+/*
+ * Fill in the page at VADDR in region RG, whose new frame is PADDR.
+ * The part of it that is backed by a file, [START, END), is read in;
+ * the rest is zeroed. (Pages with no file part at all come zeroed
+ * from vm_allocframe instead.) A mapped file may end partway into
+ * the page, or before it; what is past its end reads as zero.
+ */
+static
+int
+vm_loadpage(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	    paddr_t paddr, unsigned start, unsigned end)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct vnode *v;
+	char *kva;
+	int result;
+
+	kva = (char *)PADDR_TO_KVADDR(paddr);
+	bzero(kva, start);
+	bzero(kva + end, PAGE_SIZE - end);
+
+	v = vm_backingvnode(as, rg);
+	KASSERT(v != NULL);
+	uio_kinit(&iov, &ku, kva + start, end - start,
+		  vm_fileoffset(&rg->rg_back, vaddr) + start, UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0 && rg->rg_vnode == NULL) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	bzero(kva + end - ku.uio_resid, ku.uio_resid);
+
+	vmstats_inc(rg->rg_vnode != NULL ? VMSTAT_MAPPED_FILE_READ :
+		    VMSTAT_ELF_FILE_READ);
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	return 0;
+}
+
+/*
+ * Bring in the non-resident page at VADDR in region RG, whose PTE is
+ * PTE: from the compressed pool or swap if it is there, otherwise for
+ * the first time. The pages are unlocked during disk reads, with the
+ * PTE marked busy.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	  uint32_t *pte)
+{
+	paddr_t paddr, cached;
+	unsigned slot, start, end;
+	bool zerofill, shared;
+	int result;
+
+	KASSERT(!(*pte & PTE_INCORE));
+
+	start = end = 0;
+
+	/*
+	 * A first touch either reads the file or zero-fills. Read-only
+	 * file pages, and all file pages of mmap regions, come from the
+	 * page cache the first time. Private writeable ones are copied
+	 * on write; once copied they are ordinary pages and may have
+	 * gone to swap.
+	 */
+	zerofill = *pte == 0 &&
+		!vm_filerange(&rg->rg_back, vaddr, &start, &end);
+	shared = *pte == 0 && !zerofill &&
+		(!(rg->rg_perms & RG_WRITE) || (rg->rg_flags & RG_MAPPED));
+	if (shared) {
+		paddr = pagecache_lookup(vm_backingvnode(as, rg),
+					 vm_fileoffset(&rg->rg_back, vaddr),
+					 start, end, as, vaddr);
+		if (paddr != 0) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_CACHED);
+			*pte = paddr | PTE_INCORE | PTE_VALID;
+			return 0;
+		}
+	}
+
+	paddr = vm_allocframe(as, vaddr, zerofill);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Look at the PTE only now; making room may have spilled it, or
+	 * be spilling it still.
+	 */
+	while (*pte & PTE_BUSY) {
+		vm_pagewait();
+	}
+	if (*pte & PTE_ZSWAPPED) {
+		zswap_load(PTE_SLOT(*pte), paddr);
+		zswap_free(PTE_SLOT(*pte));
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZSWAP);
+		*pte = paddr | PTE_INCORE | PTE_VALID | PTE_DIRTY;
+		if (rg->rg_perms & RG_WRITE) {
+			*pte |= PTE_WRITE;
+		}
+	}
+	else if (*pte & PTE_SWAPPED) {
+		slot = PTE_SLOT(*pte);
+		*pte |= PTE_BUSY;
+		vm_unlockpages();
+		result = swap_in(slot, paddr);
+		vm_lockpages();
+		vm_pageunbusy(pte);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		swap_free(slot);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		/* It has nowhere else to go now; treat it as written. */
+		*pte = paddr | PTE_INCORE | PTE_VALID | PTE_DIRTY;
+		if (rg->rg_perms & RG_WRITE) {
+			*pte |= PTE_WRITE;
+		}
+	}
+	else if (zerofill) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		*pte = paddr | PTE_INCORE | PTE_VALID;
+	}
+	else {
+		*pte |= PTE_BUSY;
+		vm_unlockpages();
+		result = vm_loadpage(as, rg, vaddr, paddr, start, end);
+		vm_lockpages();
+		vm_pageunbusy(pte);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		if (shared) {
+			/* Somebody else may have read it in meanwhile. */
+			cached = pagecache_lookup(vm_backingvnode(as, rg),
+					vm_fileoffset(&rg->rg_back, vaddr),
+					start, end, as, vaddr);
+			if (cached != 0) {
+				coremap_free(paddr);
+				*pte = cached | PTE_INCORE | PTE_VALID;
+				return 0;
+			}
+			result = pagecache_insert(vm_backingvnode(as, rg),
+					vm_fileoffset(&rg->rg_back, vaddr),
+					start, end, paddr);
+			/*
+			 * Without the cache a private page is just a
+			 * page, but a MAP_SHARED one must not go to
+			 * swap, so it has to be in the cache.
+			 */
+			if (result && (rg->rg_flags & RG_SHARED)) {
+				coremap_free(paddr);
+				return result;
+			}
+		}
+		*pte = paddr | PTE_INCORE | PTE_VALID;
+	}
+	return 0;
+}
+
+int
+vm_writeback(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	off_t offset;
+	size_t len;
+	char *kva;
+	int result;
+
+	KASSERT(rg->rg_flags & RG_SHARED);
+	KASSERT(rg->rg_vnode != NULL);
+
+	/* Writing through a mapping doesn't make the file longer. */
+	result = VOP_STAT(rg->rg_vnode, &st);
+	if (result) {
+		return result;
+	}
+	offset = vm_fileoffset(&rg->rg_back, vaddr);
+	if (st.st_size <= offset) {
+		/* Past the end of the file; nowhere to write it. */
+		return 0;
+	}
+	len = PAGE_SIZE;
+	if (st.st_size - offset < (off_t)len) {
+		len = st.st_size - offset;
+	}
+
+	kva = (char *)PADDR_TO_KVADDR(paddr);
+	uio_kinit(&iov, &ku, kva, len, offset, UIO_WRITE);
+	result = VOP_WRITE(rg->rg_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	return ku.uio_resid == 0 ? 0 : ENOSPC;
+}
+
+/*
+ * Page in up to NPAGES pages of region RG from VADDR on, ahead of use.
+ * Prefetched pages are mapped without PTE_VALID and with PTE_PREFETCH,
+ * so that the first touch still comes to vm_fault (cheaply; the page
+ * is already there) and can be counted and keep fault-around going,
+ * and so that the pageout clock takes them first if they never get
+ * used.
+ */
+static
+void
+vm_prefetchpages(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+		 size_t npages)
+{
+	vaddr_t va, top;
+	uint32_t *pte;
+	size_t i;
+
+	top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	va = vaddr;
+	for (i=0; i<npages && va < top; i++, va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, true);
+		if (pte == NULL) {
+			break;
+		}
+		if (*pte & PTE_INCORE) {
+			/* Prefetched last time round, most likely. */
+			continue;
+		}
+		if (vm_pagein(as, rg, va, pte)) {
+			break;
+		}
+		*pte = (*pte & ~PTE_VALID) | PTE_PREFETCH;
+		vmstats_inc(VMSTAT_PREFETCH);
+	}
+}
+
+/*
+ * Behind a sequential sweep through RG at VADDR: the page
+ * VM_FAULTAROUND_SEQMAX back won't be wanted again. Free it if it is
+ * clean; otherwise demote it so the pageout clock takes it next.
+ */
+static
+void
+vm_dropbehind(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	vaddr_t va;
+	uint32_t *pte;
+
+	if (vaddr - rg->rg_vbase < VM_FAULTAROUND_SEQMAX * PAGE_SIZE) {
+		return;
+	}
+	va = vaddr - VM_FAULTAROUND_SEQMAX * PAGE_SIZE;
+	pte = pt_lookup(as->as_pt, va, false);
+	if (pte == NULL || !(*pte & PTE_INCORE) || (*pte & PTE_BUSY)) {
+		return;
+	}
+
+	*pte &= ~PTE_VALID;
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = va;
+	vm_tlbshootdown_sync(&ts, 1);
+
+	if (!(*pte & PTE_DIRTY)) {
+		/* It can be had again from the file, or zeroed. */
+		coremap_unshare(*pte & PTE_FRAME, as, va);
+		*pte = 0;
+	}
+}
+
+/*
+ * Fault-around. A fault that is on the page after the region's last
+ * one (counting touches of prefetched pages, which fault too) looks
+ * like a sequential sweep, and the next rg_fawindow pages past VADDR
+ * are paged in ahead of time. The window doubles, up to
+ * VM_FAULTAROUND_MAX, for as long as the sweep goes on, and collapses
+ * on the first fault anywhere else. MADV_RANDOM regions get none of
+ * this; MADV_SEQUENTIAL ones assume every fault is part of a sweep,
+ * use the largest window straight away, and drop pages behind it.
+ */
+static
+void
+vm_faultaround(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	bool seq;
+
+	if (rg->rg_advice == MADV_RANDOM) {
+		return;
+	}
+	seq = rg->rg_advice == MADV_SEQUENTIAL;
+
+	if (vaddr != rg->rg_fanext && !seq) {
+		rg->rg_fanext = vaddr + PAGE_SIZE;
+		rg->rg_fawindow = 0;
+		return;
+	}
+	rg->rg_fanext = vaddr + PAGE_SIZE;
+	if (seq) {
+		rg->rg_fawindow = VM_FAULTAROUND_SEQMAX;
+	}
+	else if (rg->rg_fawindow == 0) {
+		rg->rg_fawindow = VM_FAULTAROUND_MIN;
+	}
+	else if (rg->rg_fawindow < VM_FAULTAROUND_MAX) {
+		rg->rg_fawindow *= 2;
+	}
+
+	vm_prefetchpages(as, rg, vaddr + PAGE_SIZE, rg->rg_fawindow);
+	if (seq) {
+		vm_dropbehind(as, rg, vaddr);
+	}
+}
+
+void
+vm_prefetch(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	    size_t npages)
+{
+	vm_lockpages();
+	vm_prefetchpages(as, rg, vaddr, npages);
+	vm_unlockpages();
+}
+
+void
+vm_premap(struct addrspace *as)
+{
+	struct region *rg;
+	uint32_t *pte;
+	paddr_t paddr;
+	vaddr_t va;
+	unsigned i, num, start, end;
+	size_t j;
+
+	vm_lockpages();
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_perms & RG_WRITE) {
+			continue;
+		}
+		for (j=0; j<rg->rg_npages; j++) {
+			va = rg->rg_vbase + j * PAGE_SIZE;
+			if (!vm_filerange(&rg->rg_back, va, &start, &end)) {
+				continue;
+			}
+			paddr = pagecache_lookup(vm_backingvnode(as, rg),
+					vm_fileoffset(&rg->rg_back, va),
+					start, end, as, va);
+			if (paddr == 0) {
+				continue;
+			}
+			pte = pt_lookup(as->as_pt, va, true);
+			if (pte == NULL) {
+				/* Never mind; it will fault in. */
+				coremap_unshare(paddr, as, va);
+				goto done;
+			}
+			KASSERT(*pte == 0);
+			*pte = paddr | PTE_INCORE | PTE_VALID;
+		}
+	}
+ done:
+	vm_unlockpages();
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	uint32_t *pte;
+	uint32_t ehi, elo;
+	bool faultaround;
+	int spl, result;
+
+	faultaddress &= PAGE_FRAME;
+	faultaround = false;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL || rg->rg_perms == 0) {
+		/* Not mapped, or a guard page. */
+		return EFAULT;
+	}
+	if (faulttype != VM_FAULT_READ && !(rg->rg_perms & RG_WRITE)) {
+		return EFAULT;
+	}
+
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+
+	/*
+	 * A page that is resident and valid only needs to go back in
+	 * the TLB, and that doesn't need vm_pagelock: at splhigh the
+	 * pageout clock can't get the TLB shootdown for it to this cpu
+	 * until the entry is in, so it gets thrown out again if the
+	 * page was demoted meanwhile. Anything that has to change the
+	 * PTE goes the slow way.
+	 */
+	spl = splhigh();
+	pte = pt_lookup(as->as_pt, faultaddress, false);
+	if (pte != NULL && (*pte & (PTE_INCORE | PTE_VALID)) ==
+	    (PTE_INCORE | PTE_VALID) &&
+	    !(*pte & (PTE_PREFETCH | PTE_BUSY)) &&
+	    (faulttype == VM_FAULT_READ || (*pte & PTE_WRITE))) {
+		ehi = faultaddress | (as->as_asid << TLBHI_PIDSHIFT);
+		elo = *pte & ~PTE_SWBITS;
+		if (faulttype == VM_FAULT_READONLY) {
+			vm_tlbupdate(ehi, elo);
+		}
+		else {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			curthread->t_tlbfaults++;
+			vm_tlbinsert(ehi, elo);
+		}
+		splx(spl);
+		return 0;
+	}
+	splx(spl);
+
+	vm_lockpages();
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+	/* Wait out pageout or another fault working on it. */
+	while (*pte & PTE_BUSY) {
+		vm_pagewait();
+	}
+
+	if (*pte & PTE_INCORE) {
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			curthread->t_tlbfaults++;
+		}
+		if (*pte & PTE_PREFETCH) {
+			vmstats_inc(VMSTAT_PREFETCH_USED);
+			*pte &= ~PTE_PREFETCH;
+			faultaround = true;
+		}
+		/* Referenced, if the pageout clock had demoted it. */
+		*pte |= PTE_VALID;
+	}
+	else {
+		result = vm_pagein(as, rg, faultaddress, pte);
+		if (result) {
+			goto out;
+		}
+		faultaround = true;
+	}
+
+	/*
+	 * A write to a page in a writeable region that isn't mapped
+	 * writeable: it is clean, or shared copy-on-write.
+	 */
+	if (faulttype != VM_FAULT_READ && !(*pte & PTE_WRITE)) {
+		result = vm_writefault(as, rg, faultaddress, pte);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* PTEs are in TLBLO format; see pagetable.h. */
+	elo = *pte & ~PTE_SWBITS;
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, elo & PTE_FRAME);
+
+	/*
+	 * Load the TLB before dropping vm_pagelock, so that the page
+	 * can't be paged out in between.
+	 *
+	 * Disable interrupts on this CPU while frobbing the TLB.
+	 */
+	spl = splhigh();
+	/*
+	 * Read the ASID only now: if we slept loading the page, it may
+	 * have been reassigned when we were switched back in.
+	 */
+	ehi = faultaddress | (as->as_asid << TLBHI_PIDSHIFT);
+	if (faulttype == VM_FAULT_READONLY) {
+		vm_tlbupdate(ehi, elo);
+	}
+	else {
+		vm_tlbinsert(ehi, elo);
+	}
+	splx(spl);
+
+	/*
+	 * Only now, since it may page out anything, including the page
+	 * just loaded; the TLB shootdown would take care of that.
+	 */
+	if (faultaround) {
+		vm_faultaround(as, rg, faultaddress);
+	}
+	result = 0;
+
+ out:
+	vm_unlockpages();
+	return result;
+}
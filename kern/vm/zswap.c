@@ -0,0 +1,511 @@
+/*
+ * Compressed in-memory swap. See zswap.h for the interface.
+ *
+ * The pool is divided into ZS_CHUNKSIZE-byte chunks, and a compressed
+ * page takes a chain of them, so the pool doesn't fragment. Each
+ * stored page has an entry; entries in use are kept on a list in the
+ * order they were stored, which is the order they are spilled in.
+ * Pages whose words are all the same (mostly zero pages) take no
+ * chunks at all, just the word in their entry.
+ *
+ * The compressor works a 32-bit word at a time. Each word gets a
+ * 2-bit tag saying that it is zero, that it equals the word before
+ * it, that it is within a signed byte of the word before it (and the
+ * difference follows), or none of these (and the word follows). That
+ * suits zero-filled heap, runs of equal values and arrays of small or
+ * steadily changing numbers like matmult's, for a few cycles a word.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <zswap.h>
+#include <uw-vmstats.h>
+
+#define ZS_CHUNKSIZE     128
+#define ZS_NONE          0xffff
+#define ZS_POOLFRACTION  16	/* the pool is 1/16 of memory, */
+#define ZS_MINPOOL       4	/* but at least this many pages */
+#define ZS_MAXPOOL       ((ZS_NONE - 1) / (PAGE_SIZE / ZS_CHUNKSIZE))
+
+#define ZS_NWORDS        (PAGE_SIZE / sizeof(uint32_t))
+#define ZS_TAGBYTES      (ZS_NWORDS / 4)
+#define ZS_MAXCHUNKS     DIVROUNDUP(ZSWAP_MAXSIZE, ZS_CHUNKSIZE)
+
+/* Word tags. */
+#define ZS_ZERO          0
+#define ZS_REPEAT        1
+#define ZS_DELTA         2
+#define ZS_LITERAL       3
+
+struct zentry {
+	struct addrspace *ze_as;	/* owner; NULL if free */
+	vaddr_t ze_vaddr;		/* where the owner maps it */
+	uint32_t ze_fill;		/* the word, if same-filled */
+	uint16_t ze_size;		/* compressed size; 0 if same-filled */
+	uint16_t ze_chunk;		/* first chunk */
+	uint16_t ze_prev;		/* store order */
+	uint16_t ze_next;		/* store order, or free list */
+};
+
+static bool zs_ready = false;
+static uint8_t *zs_pool;
+static unsigned zs_poolpages;
+static unsigned zs_nchunks;		/* also the number of entries */
+static uint16_t *zs_chunknext;		/* chunk chains and free list */
+static struct zentry *zs_entries;
+
+static uint16_t zs_freechunk, zs_freeentry;
+static unsigned zs_nfreechunks;
+static uint16_t zs_oldest, zs_newest;
+static unsigned zs_nstored, zs_nfilled;
+
+static uint8_t zs_buf[ZSWAP_MAXSIZE];	/* compressed data, contiguous */
+static paddr_t zs_bounce;		/* page being spilled */
+static bool zs_spilling;		/* zs_bounce is in use */
+
+////////////////////////////////////////////////////////////
+//
+// Compression
+
+/*
+ * Compress the page SRC into DST. Returns the compressed size, or 0
+ * if it would be bigger than ZSWAP_MAXSIZE.
+ */
+static
+size_t
+zs_compress(const uint32_t *src, uint8_t *dst)
+{
+	uint8_t *body = dst + ZS_TAGBYTES;
+	size_t len, max;
+	uint32_t w, d, prev;
+	unsigned i, tag;
+
+	bzero(dst, ZS_TAGBYTES);
+	max = ZSWAP_MAXSIZE - ZS_TAGBYTES;
+	len = 0;
+	prev = 0;
+	for (i=0; i<ZS_NWORDS; i++) {
+		w = src[i];
+		d = w - prev;
+		if (w == 0) {
+			tag = ZS_ZERO;
+		}
+		else if (d == 0) {
+			tag = ZS_REPEAT;
+		}
+		else if (d + 128 < 256) {
+			/* -128 <= d <= 127 */
+			if (len + 1 > max) {
+				return 0;
+			}
+			body[len++] = d & 0xff;
+			tag = ZS_DELTA;
+		}
+		else {
+			if (len + sizeof(w) > max) {
+				return 0;
+			}
+			memcpy(body + len, &w, sizeof(w));
+			len += sizeof(w);
+			tag = ZS_LITERAL;
+		}
+		dst[i / 4] |= tag << (2 * (i % 4));
+		prev = w;
+	}
+	return ZS_TAGBYTES + len;
+}
+
+static
+void
+zs_decompress(const uint8_t *src, uint32_t *dst)
+{
+	const uint8_t *body = src + ZS_TAGBYTES;
+	size_t len;
+	uint32_t w, prev;
+	unsigned i;
+
+	len = 0;
+	prev = 0;
+	for (i=0; i<ZS_NWORDS; i++) {
+		switch ((src[i / 4] >> (2 * (i % 4))) & 3) {
+		    case ZS_ZERO:
+			w = 0;
+			break;
+		    case ZS_REPEAT:
+			w = prev;
+			break;
+		    case ZS_DELTA:
+			w = prev + (uint32_t)(int32_t)(int8_t)body[len++];
+			break;
+		    default:
+			memcpy(&w, body + len, sizeof(w));
+			len += sizeof(w);
+			break;
+		}
+		dst[i] = w;
+		prev = w;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pool
+
+/*
+ * Take entry E off the store-order list.
+ */
+static
+void
+zs_unlink(uint16_t e)
+{
+	struct zentry *ze = &zs_entries[e];
+
+	if (ze->ze_prev != ZS_NONE) {
+		zs_entries[ze->ze_prev].ze_next = ze->ze_next;
+	}
+	else {
+		zs_oldest = ze->ze_next;
+	}
+	if (ze->ze_next != ZS_NONE) {
+		zs_entries[ze->ze_next].ze_prev = ze->ze_prev;
+	}
+	else {
+		zs_newest = ze->ze_prev;
+	}
+}
+
+/*
+ * Put entry E at the new end of the store-order list.
+ */
+static
+void
+zs_append(uint16_t e)
+{
+	struct zentry *ze = &zs_entries[e];
+
+	ze->ze_prev = zs_newest;
+	ze->ze_next = ZS_NONE;
+	if (zs_newest != ZS_NONE) {
+		zs_entries[zs_newest].ze_next = e;
+	}
+	else {
+		zs_oldest = e;
+	}
+	zs_newest = e;
+}
+
+/*
+ * Decompress entry E into the frame at PA.
+ */
+static
+void
+zs_load(uint16_t e, paddr_t pa)
+{
+	struct zentry *ze = &zs_entries[e];
+	uint32_t *dst;
+	uint16_t c;
+	size_t done, n;
+	unsigned i;
+
+	dst = (uint32_t *)PADDR_TO_KVADDR(pa);
+	if (ze->ze_size == 0) {
+		for (i=0; i<ZS_NWORDS; i++) {
+			dst[i] = ze->ze_fill;
+		}
+		return;
+	}
+
+	/* Gather the chain into zs_buf first. */
+	c = ze->ze_chunk;
+	for (done = 0; done < ze->ze_size; done += n) {
+		KASSERT(c != ZS_NONE);
+		n = ze->ze_size - done;
+		if (n > ZS_CHUNKSIZE) {
+			n = ZS_CHUNKSIZE;
+		}
+		memcpy(zs_buf + done, zs_pool + c * ZS_CHUNKSIZE, n);
+		c = zs_chunknext[c];
+	}
+	zs_decompress(zs_buf, dst);
+}
+
+/*
+ * Free entry E, which is off the store-order list, and its chunks.
+ */
+static
+void
+zs_discard(uint16_t e)
+{
+	struct zentry *ze = &zs_entries[e];
+	uint16_t c, next;
+
+	KASSERT(ze->ze_as != NULL);
+
+	for (c = ze->ze_size > 0 ? ze->ze_chunk : ZS_NONE; c != ZS_NONE;
+	     c = next) {
+		next = zs_chunknext[c];
+		zs_chunknext[c] = zs_freechunk;
+		zs_freechunk = c;
+		zs_nfreechunks++;
+	}
+
+	if (ze->ze_size == 0) {
+		zs_nfilled--;
+	}
+	zs_nstored--;
+	ze->ze_as = NULL;
+	ze->ze_next = zs_freeentry;
+	zs_freeentry = e;
+}
+
+/*
+ * Free entry E and its chunks.
+ */
+static
+void
+zs_release(uint16_t e)
+{
+	zs_unlink(e);
+	zs_discard(e);
+}
+
+/*
+ * Make room by writing the oldest page in the pool to the swap device
+ * and pointing its owner's PTE there.
+ *
+ * The pages are unlocked for the write. Meanwhile the entry is off
+ * the store-order list, so nobody else spills it, and its owner's PTE
+ * is busy, so nobody loads or frees it. There is one bounce frame;
+ * a second spill waits for the first.
+ */
+static
+int
+zs_spill(void)
+{
+	struct zentry *ze;
+	uint32_t *pte;
+	uint16_t e;
+	unsigned slot;
+	int result;
+
+	while (zs_spilling) {
+		vm_pagewait();
+	}
+
+	e = zs_oldest;
+	if (e == ZS_NONE) {
+		return ENOSPC;
+	}
+	ze = &zs_entries[e];
+
+	if (swap_alloc(1, &slot) == 0) {
+		return ENOSPC;
+	}
+	pte = pt_lookup(ze->ze_as->as_pt, ze->ze_vaddr, false);
+	KASSERT(pte != NULL && *pte == PTE_MKZSLOT(e));
+
+	zs_load(e, zs_bounce);
+	zs_unlink(e);
+	*pte |= PTE_BUSY;
+	zs_spilling = true;
+
+	vm_unlockpages();
+	result = swap_out(slot, &zs_bounce, 1);
+	vm_lockpages();
+
+	zs_spilling = false;
+	if (result) {
+		/* Keep it, as the oldest still. */
+		swap_free(slot);
+		ze->ze_prev = ZS_NONE;
+		ze->ze_next = zs_oldest;
+		if (zs_oldest != ZS_NONE) {
+			zs_entries[zs_oldest].ze_prev = e;
+		}
+		else {
+			zs_newest = e;
+		}
+		zs_oldest = e;
+		vm_pageunbusy(pte);
+		return result;
+	}
+
+	vm_pageunbusy(pte);
+	*pte = PTE_MKSLOT(slot);
+	zs_discard(e);
+	vmstats_inc(VMSTAT_ZSWAP_SPILL);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+zswap_bootstrap(void)
+{
+	vaddr_t pool, bounce;
+	unsigned i;
+
+	zs_poolpages = coremap_nframes() / ZS_POOLFRACTION;
+	if (zs_poolpages < ZS_MINPOOL) {
+		zs_poolpages = ZS_MINPOOL;
+	}
+	if (zs_poolpages > ZS_MAXPOOL) {
+		zs_poolpages = ZS_MAXPOOL;
+	}
+	zs_nchunks = zs_poolpages * (PAGE_SIZE / ZS_CHUNKSIZE);
+
+	pool = alloc_kpages(zs_poolpages);
+	bounce = alloc_kpages(1);
+	zs_chunknext = kmalloc(zs_nchunks * sizeof(uint16_t));
+	zs_entries = kmalloc(zs_nchunks * sizeof(struct zentry));
+	if (pool == 0 || bounce == 0 || zs_chunknext == NULL ||
+	    zs_entries == NULL) {
+		kprintf("zswap: Out of memory; compressed swap disabled\n");
+		if (pool != 0) {
+			free_kpages(pool);
+		}
+		if (bounce != 0) {
+			free_kpages(bounce);
+		}
+		kfree(zs_chunknext);
+		kfree(zs_entries);
+		return;
+	}
+	zs_pool = (uint8_t *)pool;
+	zs_bounce = KVADDR_TO_PADDR(bounce);
+
+	for (i=0; i<zs_nchunks; i++) {
+		zs_chunknext[i] = i + 1 < zs_nchunks ? i + 1 : ZS_NONE;
+		zs_entries[i].ze_as = NULL;
+		zs_entries[i].ze_next = zs_chunknext[i];
+	}
+	zs_freechunk = zs_freeentry = 0;
+	zs_nfreechunks = zs_nchunks;
+	zs_oldest = zs_newest = ZS_NONE;
+	zs_ready = true;
+
+	kprintf("zswap: %uk compressed swap pool\n",
+		zs_poolpages * PAGE_SIZE / 1024);
+}
+
+int
+zswap_store(paddr_t pa, struct addrspace *as, vaddr_t vaddr,
+	    unsigned *handle)
+{
+	const uint32_t *src;
+	struct zentry *ze;
+	uint16_t e, c, *tail;
+	size_t size, done, n;
+	unsigned i;
+
+	KASSERT(as != NULL);
+
+	if (!zs_ready) {
+		return ENOSPC;
+	}
+
+	/*
+	 * Spilling needs zs_buf, so make room for the biggest page we
+	 * would take before compressing this one into it. (Spills unlock
+	 * the pages, so others may take the room first; check again.)
+	 */
+	while (zs_freeentry == ZS_NONE || zs_nfreechunks < ZS_MAXCHUNKS) {
+		if (zs_spill()) {
+			return ENOSPC;
+		}
+	}
+
+	src = (const uint32_t *)PADDR_TO_KVADDR(pa);
+	for (i=1; i<ZS_NWORDS; i++) {
+		if (src[i] != src[0]) {
+			break;
+		}
+	}
+	if (i == ZS_NWORDS) {
+		size = 0;
+	}
+	else {
+		size = zs_compress(src, zs_buf);
+		if (size == 0) {
+			vmstats_inc(VMSTAT_ZSWAP_REJECT);
+			return E2BIG;
+		}
+	}
+
+	e = zs_freeentry;
+	ze = &zs_entries[e];
+	zs_freeentry = ze->ze_next;
+	ze->ze_as = as;
+	ze->ze_vaddr = vaddr;
+	ze->ze_fill = src[0];
+	ze->ze_size = size;
+
+	/* Scatter zs_buf over a chain of chunks. */
+	tail = &ze->ze_chunk;
+	for (done = 0; done < size; done += n) {
+		c = zs_freechunk;
+		KASSERT(c != ZS_NONE);
+		zs_freechunk = zs_chunknext[c];
+		zs_nfreechunks--;
+		n = size - done;
+		if (n > ZS_CHUNKSIZE) {
+			n = ZS_CHUNKSIZE;
+		}
+		memcpy(zs_pool + c * ZS_CHUNKSIZE, zs_buf + done, n);
+		*tail = c;
+		tail = &zs_chunknext[c];
+	}
+	*tail = ZS_NONE;
+
+	zs_append(e);
+	zs_nstored++;
+	if (size == 0) {
+		zs_nfilled++;
+	}
+
+	vmstats_inc(VMSTAT_ZSWAP_STORE);
+	vmstats_add(VMSTAT_ZSWAP_BYTES, size > 0 ? size : sizeof(uint32_t));
+
+	*handle = e;
+	return 0;
+}
+
+void
+zswap_load(unsigned handle, paddr_t pa)
+{
+	KASSERT(zs_ready);
+	KASSERT(handle < zs_nchunks);
+	KASSERT(zs_entries[handle].ze_as != NULL);
+
+	zs_load(handle, pa);
+}
+
+void
+zswap_free(unsigned handle)
+{
+	KASSERT(zs_ready);
+	KASSERT(handle < zs_nchunks);
+
+	zs_release(handle);
+}
+
+void
+zswap_printstats(void)
+{
+	if (!zs_ready) {
+		kprintf("Zswap: none\n");
+		return;
+	}
+	kprintf("Zswap: %uk pool, %u pages stored (%u same-filled) "
+		"in %u of %u chunks\n", zs_poolpages * PAGE_SIZE / 1024,
+		zs_nstored, zs_nfilled, zs_nchunks - zs_nfreechunks,
+		zs_nchunks);
+}
@@ -0,0 +1,17 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+/*
+ * Memory mapping.
+ */
+
+#include <sys/types.h>
+
+/* Get the PROT_*, MAP_* and MADV_* constants from the kernel */
+#include <kern/mman.h>
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int madvise(void *addr, size_t len, int advice);
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE (4096)
+#define PAGES     (64)
+#define SIZE      (PAGE_SIZE * PAGES / sizeof(int))
+
+/*
+ * Map anonymous memory, fill it, check it and unmap it, a few times
+ * over so that the address gets reused. Check that madvise DONTNEED
+ * throws pages away. Then make sure the things mmap shouldn't do fail
+ * properly.
+ */
+int
+main()
+{
+	unsigned int *array;
+	unsigned int i, round;
+	void *p;
+
+	for (round = 0; round < 4; round++) {
+		array = mmap(NULL, SIZE * sizeof(int), PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (array == MAP_FAILED) {
+			printf("FAILED mmap round %u: errno %d\n", round, errno);
+			exit(1);
+		}
+		for (i=0; i<SIZE; i++) {
+			if (array[i] != 0) {
+				printf("FAILED array[%u] = %u not zero\n",
+				       i, array[i]);
+				exit(1);
+			}
+			array[i] = i + round;
+		}
+		for (i=0; i<SIZE; i++) {
+			if (array[i] != i + round) {
+				printf("FAILED array[%u] = %u != %u\n",
+				       i, array[i], i + round);
+				exit(1);
+			}
+		}
+		if (munmap(array, SIZE * sizeof(int)) != 0) {
+			printf("FAILED munmap round %u: errno %d\n",
+			       round, errno);
+			exit(1);
+		}
+	}
+
+	/* Dropped pages come back zero-filled. */
+	array = mmap(NULL, SIZE * sizeof(int), PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (array == MAP_FAILED) {
+		printf("FAILED mmap for madvise: errno %d\n", errno);
+		exit(1);
+	}
+	if (madvise(array, SIZE * sizeof(int), MADV_SEQUENTIAL) != 0) {
+		printf("FAILED madvise SEQUENTIAL: errno %d\n", errno);
+		exit(1);
+	}
+	for (i=0; i<SIZE; i++) {
+		array[i] = i;
+	}
+	if (madvise(array, SIZE * sizeof(int) / 2, MADV_DONTNEED) != 0) {
+		printf("FAILED madvise DONTNEED: errno %d\n", errno);
+		exit(1);
+	}
+	if (madvise(array, SIZE * sizeof(int), MADV_WILLNEED) != 0) {
+		printf("FAILED madvise WILLNEED: errno %d\n", errno);
+		exit(1);
+	}
+	for (i=0; i<SIZE; i++) {
+		if (array[i] != (i < SIZE / 2 ? 0 : i)) {
+			printf("FAILED after DONTNEED array[%u] = %u\n",
+			       i, array[i]);
+			exit(1);
+		}
+	}
+	if (madvise(array, PAGE_SIZE, 99) == 0 || errno != EINVAL) {
+		printf("FAILED madvise with bad advice\n");
+		exit(1);
+	}
+	munmap(array, SIZE * sizeof(int));
+
+	/* The console isn't a file. */
+	p = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, STDOUT_FILENO, 0);
+	if (p != MAP_FAILED || errno != ENODEV) {
+		printf("FAILED mmap of stdout\n");
+		exit(1);
+	}
+
+	/* Neither shared nor private. */
+	p = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_ANON, -1, 0);
+	if (p != MAP_FAILED || errno != EINVAL) {
+		printf("FAILED mmap without MAP_SHARED or MAP_PRIVATE\n");
+		exit(1);
+	}
+
+	/* Anonymous memory has nobody to be shared with. */
+	p = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED | MAP_ANON, -1, 0);
+	if (p != MAP_FAILED || errno != EINVAL) {
+		printf("FAILED mmap of shared anonymous memory\n");
+		exit(1);
+	}
+
+	/* The text segment isn't a mapping. */
+	if (munmap((void *)main, PAGE_SIZE) == 0 || errno != EINVAL) {
+		printf("FAILED munmap of text\n");
+		exit(1);
+	}
+
+	printf("SUCCEEDED\n");
+	exit(0);
+}